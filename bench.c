@@ -0,0 +1,402 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Offline WildKeccak benchmark suite: hashes a synthetic scratchpad with
+// every combination of page type, thread count, kernel and lane count and
+// reports hashrate and per-batch latency, without touching a pool.  The
+// scratchpad line number reduction of each kernel, and the hex codec used
+// for jobs, addenda and scratchpad downloads, have separate throughput runs.
+
+#include "cpuminer-config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <jansson.h>
+#include "miner.h"
+#include "xmalloc.h"
+
+#define BENCH_BATCH  64    /* nonces per scanhash call, a multiple of every lane count */
+#define BENCH_SEED   0x426f6f6c62657272ULL
+#define BENCH_WORDS  4096  /* state words per line number reduction call, stays in L1 */
+#define BENCH_MIXIN  24    /* words a WildKeccak round reduces */
+
+struct bench_thread {
+    pthread_t pth;
+    int id;
+    uint32_t first_nonce;
+    volatile bool *stop;
+    unsigned long hashes;
+    double elapsed;
+    double *lat;            /* per-batch latency, microseconds */
+    size_t nlat, maxlat;
+};
+
+struct bench_result {
+    int pages, threads, lanes;
+    const char *kernel;
+    double hps, ns_per_hash, p50, p99;
+};
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_thread *bt = arg;
+    uint32_t data[32], target[8];
+    struct wk_midstate mid;
+    uint32_t *nonceptr = (uint32_t *)(((char *)data) + 1);
+    uint32_t n = bt->first_nonce;
+    unsigned long done;
+    double start, t0, t1;
+
+    memset(data, 0x55, sizeof(data));
+    memset(target, 0, sizeof(target)); /* never met, every batch runs to the end */
+    wild_keccak_midstate_init(&mid, (const uint8_t *)data, 81);
+
+    start = t0 = bench_now();
+    while (!*bt->stop) {
+        *nonceptr = n;
+        scanhash_wildkeccak(bt->id, data, &mid, target, n + BENCH_BATCH - 1, &done, NULL);
+        t1 = bench_now();
+        n += BENCH_BATCH;
+        bt->hashes += done;
+        if (bt->nlat == bt->maxlat) {
+            bt->maxlat = bt->maxlat ? bt->maxlat * 2 : 4096;
+            bt->lat = xrealloc(bt->lat, bt->maxlat, sizeof(*bt->lat));
+        }
+        bt->lat[bt->nlat++] = 1e6 * (t1 - t0);
+        t0 = t1;
+    }
+    bt->elapsed = t0 - start;
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static bool bench_run(struct bench_result *r, int threads, int seconds)
+{
+    struct bench_thread *bt = xcalloc(threads, sizeof(*bt));
+    volatile bool stop = false;
+    double *lat;
+    size_t nlat = 0;
+    int i, started;
+
+    for (started = 0; started < threads; started++) {
+        bt[started].id = started;
+        bt[started].first_nonce = 0xffffffffU / threads * started;
+        bt[started].stop = &stop;
+        if (pthread_create(&bt[started].pth, NULL, bench_thread, &bt[started])) {
+            applog(LOG_ERR, "benchmark thread create failed");
+            break;
+        }
+    }
+    if (started == threads)
+        sleep(seconds);
+    stop = true;
+    for (i = 0; i < started; i++)
+        pthread_join(bt[i].pth, NULL);
+
+    r->hps = 0;
+    for (i = 0; i < started; i++) {
+        if (bt[i].elapsed > 0)
+            r->hps += bt[i].hashes / bt[i].elapsed;
+        nlat += bt[i].nlat;
+    }
+    r->ns_per_hash = r->hps ? 1e9 / r->hps : 0;
+
+    lat = xmalloc((nlat ? nlat : 1) * sizeof(*lat));
+    for (i = 0, nlat = 0; i < started; i++) {
+        memcpy(lat + nlat, bt[i].lat, bt[i].nlat * sizeof(*lat));
+        nlat += bt[i].nlat;
+        free(bt[i].lat);
+    }
+    qsort(lat, nlat, sizeof(*lat), cmp_double);
+    r->p50 = nlat ? lat[(nlat - 1) / 2] : 0;
+    r->p99 = nlat ? lat[(nlat - 1) * 99 / 100] : 0;
+    free(lat);
+    free(bt);
+    return started == threads;
+}
+
+/* Writes report to file, or prints it after the table; takes the reference */
+static bool bench_report(json_t *report, const char *file)
+{
+    bool ok = true;
+
+    if (file) {
+        if (json_dump_file(report, file, JSON_INDENT(2) | JSON_PRESERVE_ORDER)) {
+            applog(LOG_ERR, "Failed to write benchmark report to %s", file);
+            ok = false;
+        }
+    } else {
+        char *s = json_dumps(report, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+        printf("%s\n", s);
+        free(s);
+    }
+    json_decref(report);
+    return ok;
+}
+
+static void bench_print(const struct bench_result *r)
+{
+    printf("%-8s %7d %-8s %5d %10.0f %10.1f %10.1f %10.1f\n",
+           pages_name(r->pages), r->threads, r->kernel, r->lanes,
+           r->hps, r->ns_per_hash, r->p50, r->p99);
+    fflush(stdout);
+}
+
+bool run_bench_suite(const struct bench_params *params)
+{
+    const size_t size = (size_t)params->size_mb << 20;
+    const int lane_counts[] = { 1, 2, 4, 8 };
+    struct work_restart *restart;
+    struct bench_result r;
+    json_t *report, *results;
+    const char *kname;
+    bool supported, ok = true;
+    int pages, threads, lanes, klanes, i;
+    unsigned k;
+    uint64_t seed, w;
+
+    if (size > WILD_KECCAK_SCRATCHPAD_BUFFSIZE) {
+        applog(LOG_ERR, "Benchmark scratchpad of %d MB exceeds the %d MB buffer",
+               params->size_mb, WILD_KECCAK_SCRATCHPAD_BUFFSIZE >> 20);
+        return false;
+    }
+
+    restart = xcalloc(params->max_threads, sizeof(*restart));
+    work_restart = restart;
+    results = json_array();
+
+    applog(LOG_INFO, "Benchmarking on a %d MB synthetic scratchpad, %d s per run",
+           params->size_mb, params->seconds);
+    printf("%-8s %7s %-8s %5s %10s %10s %10s %10s\n",
+           "pages", "threads", "kernel", "lanes", "h/s", "ns/hash", "p50 us", "p99 us");
+
+    for (pages = 0; pages < PAGES_MAX; pages++) {
+        int got = pages;
+
+        /* no fallback, each row has to be measured on the page type it names */
+        pscratchpad_buff = pages_alloc(size, &got, false);
+        if (!pscratchpad_buff) {
+            applog(LOG_INFO, "%s pages not available, skipping", pages_name(pages));
+            continue;
+        }
+        pages_report("Benchmark scratchpad", pscratchpad_buff, size, pages);
+        /* same contents for every page type, so runs are comparable */
+        seed = BENCH_SEED;
+        for (w = 0; w < size / 8; w++)
+            pscratchpad_buff[w] = splitmix64(&seed);
+        scratchpad_size = size / 8;
+
+        for (threads = params->threads ? params->threads : 1; threads <= params->max_threads;
+             threads = threads < params->max_threads && threads * 2 > params->max_threads ? params->max_threads : threads * 2) {
+            for (k = 0; wild_keccak_kernel_info(k, &kname, &klanes, &supported); k++) {
+                if (!supported)
+                    continue;
+                if (params->kernel && strcmp(params->kernel, "auto") && strcmp(params->kernel, kname))
+                    continue;
+                for (i = 0; i < (int)ARRAY_SIZE(lane_counts); i++) {
+                    lanes = klanes ? klanes : lane_counts[i];
+                    if (params->lanes && !klanes && lanes != params->lanes)
+                        continue;
+
+                    opt_lanes = klanes ? 0 : lanes;
+                    if (!wild_keccak_set_kernel(kname)) {
+                        ok = false;
+                        continue;
+                    }
+                    memset(&r, 0, sizeof(r));
+                    r.pages = pages;
+                    r.threads = threads;
+                    r.kernel = kname;
+                    r.lanes = lanes;
+                    if (!bench_run(&r, threads, params->seconds))
+                        ok = false;
+                    bench_print(&r);
+                    json_array_append_new(results, json_pack("{s:s, s:i, s:s, s:i, s:f, s:f, s:f, s:f}",
+                        "pages", pages_name(pages), "threads", threads,
+                        "kernel", kname, "lanes", lanes, "hashes_per_sec", r.hps,
+                        "ns_per_hash", r.ns_per_hash, "p50_batch_us", r.p50, "p99_batch_us", r.p99));
+                    if (klanes)
+                        break;
+                }
+            }
+            if (params->threads)
+                break;
+        }
+        pages_free(pscratchpad_buff, size, pages);
+        pscratchpad_buff = NULL;
+        scratchpad_size = 0;
+    }
+
+    report = json_pack("{s:i, s:i, s:i, s:i, s:i, s:o}",
+                       "scratchpad_mb", params->size_mb, "seconds", params->seconds,
+                       "batch", BENCH_BATCH, "prefetch_distance", opt_prefetch_distance,
+                       "prefetch_hint", opt_prefetch_hint, "results", results);
+    if (!bench_report(report, params->json_file))
+        ok = false;
+    work_restart = NULL;
+    free(restart);
+    return ok;
+}
+
+/* GB of binary data per second through one direction of a codec */
+static double hex_rate(const struct hex_codec *c, bool decode, unsigned char *bin, char *hex,
+                       size_t size, int seconds)
+{
+    double start = bench_now(), t;
+    unsigned long n = 0;
+
+    do {
+        if (decode)
+            c->decode(bin, hex, size);
+        else
+            c->encode(hex, bin, size);
+        n++;
+        t = bench_now() - start;
+    } while (t < seconds);
+    return n * (double)size / t / 1e9;
+}
+
+bool run_hex_bench(const struct bench_params *params)
+{
+    const size_t size = (size_t)params->size_mb << 20;
+    unsigned char *bin = xmalloc(size), *out = xmalloc(size);
+    char *ref = xmalloc(size * 2), *hex = xmalloc(size * 2);
+    const struct hex_codec *c, *scalar;
+    json_t *results = json_array();
+    double dec, enc;
+    bool ok = true;
+    uint64_t seed = BENCH_SEED, w;
+    unsigned k;
+
+    for (w = 0; w < size / 8; w++) {
+        uint64_t x = splitmix64(&seed);
+        memcpy(bin + w * 8, &x, 8);
+    }
+    /* the last codec is the plain C one */
+    for (k = 0, scalar = hex_codec_get(0); hex_codec_get(k); k++)
+        scalar = hex_codec_get(k);
+    scalar->encode(ref, bin, size);
+
+    applog(LOG_INFO, "Benchmarking hex codecs on %d MB, %d s per run", params->size_mb, params->seconds);
+    printf("%-8s %12s %12s\n", "codec", "decode GB/s", "encode GB/s");
+    for (k = 0; (c = hex_codec_get(k)); k++) {
+        /* every codec has to agree with the scalar one, and reject a bad digit */
+        c->encode(hex, bin, size);
+        if (memcmp(hex, ref, size * 2) || !c->decode(out, ref, size) || memcmp(out, bin, size)) {
+            applog(LOG_ERR, "hex codec %s gives wrong results", c->name);
+            ok = false;
+            continue;
+        }
+        ref[size - 3] = 'g';
+        if (c->decode(out, ref, size)) {
+            applog(LOG_ERR, "hex codec %s accepts invalid hex", c->name);
+            ok = false;
+        }
+        ref[size - 3] = hex[size - 3];
+
+        dec = hex_rate(c, true, out, ref, size, params->seconds);
+        enc = hex_rate(c, false, bin, hex, size, params->seconds);
+        printf("%-8s %12.2f %12.2f\n", c->name, dec, enc);
+        fflush(stdout);
+        json_array_append_new(results, json_pack("{s:s, s:f, s:f}", "codec", c->name,
+                              "decode_gb_per_sec", dec, "encode_gb_per_sec", enc));
+    }
+
+    if (!bench_report(json_pack("{s:i, s:i, s:o}", "size_mb", params->size_mb,
+                                "seconds", params->seconds, "results", results), params->json_file))
+        ok = false;
+    free(bin);
+    free(out);
+    free(ref);
+    free(hex);
+    return ok;
+}
+
+bool run_index_bench(const struct bench_params *params)
+{
+    const uint64_t lines = ((uint64_t)params->size_mb << 20) / 32;
+    uint64_t w[BENCH_WORDS], ref[BENCH_WORDS], idx[BENCH_WORDS];
+    json_t *results = json_array();
+    const char *kname;
+    bool supported, ok = true;
+    int klanes;
+    unsigned k, last = 0;
+    uint64_t seed = BENCH_SEED;
+    unsigned long n;
+    double start, t;
+    size_t i;
+
+    for (i = 0; i < BENCH_WORDS; i++)
+        w[i] = splitmix64(&seed);
+    /* the edges of the reduction: zero, all ones and multiples of lines */
+    w[0] = 0;
+    w[1] = ~0ULL;
+    w[2] = lines;
+    w[3] = lines * 7 - 1;
+    w[4] = (~0ULL / lines) * lines;
+    while (wild_keccak_kernel_info(last + 1, &kname, &klanes, &supported))
+        last++;
+    wild_keccak_line_indices(last, ref, w, BENCH_WORDS, lines); /* the plain C one */
+
+    applog(LOG_INFO, "Benchmarking scratchpad line numbers for a %d MB scratchpad, %d s per run",
+           params->size_mb, params->seconds);
+    printf("%-8s %12s %14s\n", "kernel", "Mwords/s", "ns per round");
+    for (k = 0; wild_keccak_kernel_info(k, &kname, &klanes, &supported); k++) {
+        if (!supported)
+            continue;
+        memset(idx, 0, sizeof(idx));
+        wild_keccak_line_indices(k, idx, w, BENCH_WORDS, lines);
+        if (memcmp(idx, ref, sizeof(ref))) {
+            applog(LOG_ERR, "kernel %s reduces state words to the wrong lines", kname);
+            ok = false;
+            continue;
+        }
+        n = 0;
+        start = bench_now();
+        do {
+            wild_keccak_line_indices(k, idx, w, BENCH_WORDS, lines);
+            n++;
+            t = bench_now() - start;
+        } while (t < params->seconds);
+        printf("%-8s %12.1f %14.2f\n", kname, n * (double)BENCH_WORDS / t / 1e6,
+               t * 1e9 / n / BENCH_WORDS * BENCH_MIXIN);
+        fflush(stdout);
+        json_array_append_new(results, json_pack("{s:s, s:f, s:f}", "kernel", kname,
+                              "mwords_per_sec", n * (double)BENCH_WORDS / t / 1e6,
+                              "ns_per_round", t * 1e9 / n / BENCH_WORDS * BENCH_MIXIN));
+    }
+
+    if (!bench_report(json_pack("{s:i, s:i, s:o}", "scratchpad_mb", params->size_mb,
+                                "seconds", params->seconds, "results", results), params->json_file))
+        ok = false;
+    return ok;
+}
@@ -22,6 +22,7 @@
 #include <time.h>
 #if !defined(_WIN64) && !defined(_WIN32)
     #include <sys/mman.h>
+    #include <fcntl.h>
 #endif
 #ifdef WIN32
 #include <winsock2.h>
@@ -99,14 +100,15 @@ static inline void affine_to_cpu(int id, int cpu)
 #endif
 
 enum workio_commands {
-    WC_GET_WORK, WC_SUBMIT_WORK,
+    WC_GET_WORK, WC_SUBMIT_RESULTS, WC_FLUSH_RESULTS,
 };
 
 struct workio_cmd {
     enum workio_commands cmd;
     struct thr_info *thr;
     union {
-        struct work *work;
+        struct result_ring *ring;
+        struct thread_q *done;  /* WC_FLUSH_RESULTS answers here */
     } u;
 };
 
@@ -134,6 +136,20 @@ static int opt_retries = -1;
 static int opt_fail_pause = 1;
 bool jsonrpc_2 = false;
 int opt_timeout = 0;
+int opt_lanes = 0;
+static char *opt_kernel = NULL;
+int opt_prefetch_distance = WILD_KECCAK_DEFAULT_PREFETCH_DISTANCE;
+int opt_prefetch_hint = 1;
+static bool opt_bench_suite = false;
+static bool opt_bench_hex = false;
+static bool opt_bench_index = false;
+static int opt_bench_size = 64;
+static int opt_bench_time = 3;
+static char *opt_bench_json = NULL;
+static bool opt_numa = false;
+static bool opt_scratchpad_mmap = false;
+static char *opt_scratchpad_shm = NULL;
+static char *opt_scratchpad_serve = NULL;
 static int opt_scantime = 5;
 static json_t *opt_config;
 static const bool opt_time = true;
@@ -151,6 +167,7 @@ static int work_thr_id;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
 struct work_restart *work_restart = NULL;
+static struct result_ring *result_rings;
 static struct stratum_ctx stratum;
 char rpc2_id[65] = "";
 static char *rpc2_blob = NULL;
@@ -171,6 +188,38 @@ struct scratchpad_hi current_scratchpad_hi;
 static struct addendums_array_entry add_arr[WILD_KECCAK_ADDENDUMS_ARRAY_SIZE];
 static char last_found_nonce[200];
 static time_t prev_save = 0;
+static FILE *journal_fp = NULL; /* <cache>.journal, appended to as addenda come and go */
+static uint64_t journal_bytes = 0;
+static void journal_append(uint32_t type, const struct addendums_array_entry *entry, const uint64_t *data);
+static struct addendums_array_entry rollback_hist[SCRATCHPAD_ROLLBACK_DEPTH]; /* add_arr, only deeper */
+static size_t rollback_n = 0;
+static long long split_start_ms = 0; /* first chain split since addenda last applied */
+static unsigned split_attempts = 0;
+static uint64_t split_rewound = 0;
+static long long monotonic_ms(void);
+static void restart_threads(void);
+bool store_scratchpad_to_file(bool do_fsync);
+#define DOWNLOAD_DONE    1 /* download_scratchpad results */
+#define DOWNLOAD_WHOLE   0 /* no ranges, fetch the file whole */
+#define DOWNLOAD_RESUME -1 /* stopped with chunks kept in <cache>.part */
+#if !defined(_WIN64) && !defined(_WIN32)
+static int scratchpad_fd = -1; /* cache file mapped as pscratchpad_buff, --scratchpad-mmap */
+static size_t scratchpad_file_bytes; /* data the mapped file is extended to */
+#endif
+static struct pages_region scratchpad_region; /* pscratchpad_buff without --scratchpad-mmap */
+uint32_t scratchpad_seq = 0; /* odd while the scratchpad is being changed, see seed.c */
+#if defined(__linux__)
+/* "<scratchpad memfd>:<state memfd>:<page type>:<CLOCK_MONOTONIC ms of the exec>", fds -1 when not handed over */
+#define HOT_RESTART_ENV "MINERD_HOT_RESTART"
+#define HOT_RESTART_DRAIN_TIMEOUT 5 /* seconds to submit queued shares before the exec */
+static volatile sig_atomic_t hot_restart_requested = 0; /* SIGUSR2 */
+static char **restart_argv;
+static char restart_path[PATH_MAX];
+static int hot_restart_fd = -1, hot_restart_state_fd = -1, hot_restart_pages;
+#endif
+static long long hot_restart_ms = 0; /* exec of the hot restart this process came from */
+static long long start_ms, scratchpad_ready_ms; /* startup milestones for the time to first hash */
+static bool first_hash_seen = false;
 static const char * pscratchpad_url = NULL;
 static const char * pscratchpad_local_cache = NULL;
 
@@ -211,6 +260,15 @@ static char const usage[] =
     --cert=FILE       certificate for mining server using SSL\n\
     -x, --proxy=[PROTOCOL://]HOST[:PORT]  connect through a proxy\n\
     -t, --threads=N       number of miner threads (default: number of processors)\n\
+    --lanes=N         nonces hashed together per thread: 1, 2, 4 or 8, for the\n\
+                      scalar and bmi2 kernels (default: 4); avx512 always\n\
+                      hashes 8 and avx2 always 4\n\
+    --kernel=NAME     WildKeccak kernel: auto, avx512, avx2, bmi2 or scalar\n\
+                      (default: auto)\n\
+    --prefetch-distance=N  lanes the scratchpad gather runs ahead of the mixin,\n\
+                      0 prefetches a whole round up front (scalar kernel, default: 1)\n\
+    --prefetch-hint=N     cache locality of scratchpad prefetches, 0 (none) to\n\
+                      3 (keep in all levels) (default: 1)\n\
     -r, --retries=N       number of times to retry if a network call fails\n\
     (default: retry indefinitely)\n\
     -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
@@ -220,6 +278,19 @@ static char const usage[] =
     --no-longpoll     disable X-Long-Polling support\n\
     --no-stratum      disable X-Stratum support\n\
     --no-redirect     ignore requests to change the URL of the mining server\n\
+    --scratchpad-mmap map the scratchpad cache file as the mining buffer instead\n\
+                      of reading it; addenda are written to the file in place\n\
+    --scratchpad-shm=NAME share one scratchpad between the miners of a host\n\
+                      through /dev/shm/NAME, or a path such as a file on\n\
+                      hugetlbfs; one applies addenda, the others map it\n\
+                      read-only (Linux)\n\
+    --scratchpad-serve=[ADDR:]PORT  serve the current scratchpad over HTTP with\n\
+                      ranges, for other miners to download with -k\n\
+                      http://HOST:PORT/scratchpad.bin\n\
+    --pages=TYPE      scratchpad page size to try first: auto, 1g, 2m, thp or 4k;\n\
+                      falls back 1g -> 2m -> thp -> 4k (default: auto = 1g)\n\
+    --numa            keep a scratchpad replica on every NUMA node and bind\n\
+                      each thread to a node (Linux, one extra buffer per node)\n\
     -q, --quiet           disable per-thread hashmeter output\n\
     -D, --debug           enable debug output\n\
     -P, --protocol-dump   verbose dump of protocol-level activities\n"
@@ -233,10 +304,28 @@ static char const usage[] =
 #endif
     "\
     --benchmark       run in offline benchmark mode\n\
+    --bench-suite     hash a synthetic scratchpad across page types, thread\n\
+                      counts, kernels and lanes, print a report and exit;\n\
+                      --threads, --kernel and --lanes narrow the sweep\n\
+    --bench-hex       measure hex decode and encode throughput of every\n\
+                      codec the CPU supports, print a report and exit\n\
+    --bench-index     measure how fast every kernel the CPU supports turns\n\
+                      state words into scratchpad lines, print a report and exit\n\
+    --bench-size=MB   synthetic scratchpad or hex data size for --bench-suite,\n\
+                      --bench-index and --bench-hex (default: 64)\n\
+    --bench-time=N    seconds per benchmark configuration (default: 3)\n\
+    --bench-json=FILE write the benchmark JSON report to FILE\n\
+                      instead of printing it after the table\n\
     -c, --config=FILE     load a JSON-format configuration file\n\
     -V, --version         display version information and exit\n\
     -h, --help            display this help text and exit\n\
-    ";
+    "
+#if defined(__linux__)
+    "\n\
+Send SIGUSR2 for a hot restart: the miner runs its binary again and hands\n\
+the scratchpad over without reloading it.\n"
+#endif
+    ;
 
 static char const short_options[] =
 #ifndef WIN32
@@ -253,16 +342,31 @@ static struct option const options[] = {
     { "background", 0, NULL, 'B' },
 #endif
     { "benchmark", 0, NULL, 1005 },
+    { "bench-hex", 0, NULL, 1022 },
+    { "bench-index", 0, NULL, 1023 },
+    { "bench-json", 1, NULL, 1018 },
+    { "bench-size", 1, NULL, 1016 },
+    { "bench-suite", 0, NULL, 1015 },
+    { "bench-time", 1, NULL, 1017 },
     { "scratchpad", 1, NULL, 'k'},
     { "scratchpad_local_cache", 1, NULL, 'l'},
+    { "scratchpad-mmap", 0, NULL, 1021 },
+    { "scratchpad-shm", 1, NULL, 1024 },
+    { "scratchpad-serve", 1, NULL, 1025 },
     { "cert", 1, NULL, 1001 },
     { "config", 1, NULL, 'c' },
     { "debug", 0, NULL, 'D' },
     { "help", 0, NULL, 'h' },
+    { "kernel", 1, NULL, 1012 },
+    { "lanes", 1, NULL, 1011 },
     { "no-longpoll", 0, NULL, 1003 },
     { "no-redirect", 0, NULL, 1009 },
     { "no-stratum", 0, NULL, 1007 },
+    { "numa", 0, NULL, 1019 },
+    { "pages", 1, NULL, 1020 },
     { "pass", 1, NULL, 'p' },
+    { "prefetch-distance", 1, NULL, 1013 },
+    { "prefetch-hint", 1, NULL, 1014 },
     { "protocol-dump", 0, NULL, 'P' },
     { "proxy", 1, NULL, 'x' },
     { "quiet", 0, NULL, 'q' },
@@ -452,26 +556,95 @@ void reset_scratchpad(void)
 {
     current_scratchpad_hi.height = 0;
     scratchpad_size = 0;
+    memset(add_arr, 0, sizeof(add_arr));
+    rollback_n = 0;
     //unlink(scratchpad_file);
 }
 
 
 bool patch_scratchpad_with_addendum(uint64_t global_add_startpoint, uint64_t* padd_buff, size_t count/*uint64 units*/)
 {
-    for(int i = 0; i < count; i += 4)
+    //the master copy first, then every NUMA replica
+    for(int r = -1; r < numa_nodes; r++)
+    {
+        uint64_t* pscr = r < 0 ? pscratchpad_buff : numa_replica(r);
+        for(int i = 0; i < count; i += 4)
+        {
+            uint64_t global_offset = (padd_buff[i]%(global_add_startpoint/4))*4;
+            for(int j = 0; j != 4; j++)
+                pscr[global_offset + j] ^= padd_buff[i + j];
+        }
+    }
+    return true;
+}
+
+/*
+ * Backs the first bytes of the scratchpad buffer, growing the mapped file
+ * or shared segment or committing pages of the reserved region in
+ * huge-page steps.
+ */
+bool scratchpad_commit(size_t bytes)
+{
+    const size_t step = 2 << 20;
+    size_t before;
+
+    if(opt_scratchpad_shm)
+        return shm_commit(bytes);
+#if !defined(_WIN64) && !defined(_WIN32)
+    if(scratchpad_fd >= 0)
+    {
+        if(bytes <= scratchpad_file_bytes)
+            return true;
+        if(bytes > WILD_KECCAK_SCRATCHPAD_BUFFSIZE)
+            return false;
+        bytes = (bytes + step - 1) / step * step;
+        if(ftruncate(scratchpad_fd, SCRATCHPAD_FILE_DATA_OFFSET + bytes))
+        {
+            applog(LOG_ERR, "failed to extend %s: %s", pscratchpad_local_cache, strerror(errno));
+            return false;
+        }
+        scratchpad_file_bytes = bytes;
+        return true;
+    }
+#endif
+    before = scratchpad_region.committed;
+    if(bytes <= before)
+        return true;
+    if(!pages_commit(&scratchpad_region, bytes, true))
     {
-        uint64_t global_offset = (padd_buff[i]%(global_add_startpoint/4))*4;
-        for(int j = 0; j != 4; j++)
-            pscratchpad_buff[global_offset + j] ^= padd_buff[i + j];
+        applog(LOG_ERR, "Failed to grow the scratchpad buffer to %zu MB (%zu MB reserved)",
+               bytes >> 20, scratchpad_region.reserved >> 20);
+        return false;
     }
+    if(before)
+        applog(LOG_INFO, "Scratchpad buffer grown to %zu MB committed of %zu MB reserved",
+               scratchpad_region.committed >> 20, scratchpad_region.reserved >> 20);
     return true;
 }
 
+/* Takes the state a --scratchpad-shm writer published */
+static void shm_adopt(const struct scratchpad_file_header *fh)
+{
+    memcpy(&add_arr[0], &fh->add_arr[0], sizeof(fh->add_arr));
+    current_scratchpad_hi = fh->current_hi;
+    scratchpad_size = fh->scratchpad_size;
+}
+
+static void shm_publish_state(void)
+{
+    struct scratchpad_file_header sf = {0};
+
+    memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
+    sf.current_hi = current_scratchpad_hi;
+    sf.scratchpad_size = scratchpad_size;
+    shm_publish(&sf);
+}
+
 bool apply_addendum(uint64_t* padd_buff, size_t count/*uint64 units*/)
 {
-    if(WILD_KECCAK_SCRATCHPAD_BUFFSIZE <= (scratchpad_size + count)*8 )
+    if(!scratchpad_commit((scratchpad_size + count)*8) || !numa_commit_replicas((scratchpad_size + count)*8))
     {
-        applog(LOG_ERR, "!!!!!!! WILD_KECCAK_SCRATCHPAD_BUFFSIZE overflowed !!!!!!!! please increase this constant! ");
+        applog(LOG_ERR, "No room for a %zu word addendum past %" PRIu64 " words of scratchpad", count, (uint64_t)scratchpad_size);
         return false;
     }
 
@@ -483,11 +656,142 @@ bool apply_addendum(uint64_t* padd_buff, size_t count/*uint64 units*/)
     }
     for(int k = 0; k != count; k++)
         pscratchpad_buff[scratchpad_size+k] = padd_buff[k];
+    numa_sync_replicas(scratchpad_size, count);
 
     scratchpad_size += count;
     return true;
 }
 
+/*
+ * Rollback history.  An addendum is undone by XORing it in once more, and
+ * its words stay at the end of the scratchpad until then, so going back
+ * any number of blocks only takes the entries of the addenda on top.
+ * add_arr keeps the last ten of them for the file header, rollback_hist
+ * the last SCRATCHPAD_ROLLBACK_DEPTH.  The history is checkpointed to
+ * <cache>.rollback every few blocks and after each rewind; the entries a
+ * checkpoint lacks are in add_arr of the cache file or in its journal.
+ */
+static void rollback_name(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s.rollback", pscratchpad_local_cache);
+}
+
+static void rollback_push(const struct addendums_array_entry *entry)
+{
+    if (rollback_n == SCRATCHPAD_ROLLBACK_DEPTH)
+    {
+        memmove(&rollback_hist[0], &rollback_hist[1], (rollback_n - 1) * sizeof(rollback_hist[0]));
+        rollback_n--;
+    }
+    rollback_hist[rollback_n++] = *entry;
+}
+
+static void rollback_pop(const struct addendums_array_entry *entry)
+{
+    if (rollback_n && !memcmp(&rollback_hist[rollback_n - 1], entry, sizeof(*entry)))
+        rollback_n--;
+    else
+        rollback_n = 0; //out of step, add_arr is all there is now
+}
+
+/* The addendum to undo next: the newest in add_arr, or past it the newest in the history */
+static struct addendums_array_entry *newest_addendum(void)
+{
+    static struct addendums_array_entry deep;
+    int i;
+
+    for (i = ARRAY_SIZE(add_arr) - 1; i >= 0; i--)
+        if (add_arr[i].prev_hi.height)
+            return &add_arr[i];
+    if (!rollback_n)
+        return NULL;
+    deep = rollback_hist[rollback_n - 1];
+    return &deep;
+}
+
+static void rollback_checkpoint(void)
+{
+    char fname[PATH_MAX], tmp[PATH_MAX + 4];
+    struct scratchpad_rollback_header rh = {SCRATCHPAD_ROLLBACK_MAGIC};
+    FILE *fp;
+
+    rh.hi = current_scratchpad_hi;
+    rh.count = rollback_n;
+    rollback_name(fname, sizeof(fname));
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp))
+    {
+        applog(LOG_ERR, "rollback history path %s is too long", fname);
+        return;
+    }
+    fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        applog(LOG_ERR, "failed to create file %s: %s", tmp, strerror(errno));
+        return;
+    }
+    bool ok = fwrite(&rh, sizeof(rh), 1, fp) == 1 &&
+              fwrite(rollback_hist, sizeof(rollback_hist[0]), rollback_n, fp) == rollback_n;
+    if (fclose(fp) == EOF)
+        ok = false;
+    if (!ok || rename(tmp, fname) == -1)
+    {
+        applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Takes as much of the checkpointed history as leads up to add_arr of the state just loaded */
+static void rollback_load(void)
+{
+    char fname[PATH_MAX];
+    struct scratchpad_rollback_header rh;
+    struct scratchpad_hi *anchor;
+    size_t n = 0, k, i;
+    FILE *fp;
+
+    rollback_n = 0;
+    for (k = 0; k < ARRAY_SIZE(add_arr) && add_arr[k].prev_hi.height; k++)
+        ;
+    rollback_name(fname, sizeof(fname));
+    fp = fopen(fname, "rb");
+    if (fp)
+    {
+        if (fread(&rh, sizeof(rh), 1, fp) == 1 &&
+            !memcmp(rh.magic, SCRATCHPAD_ROLLBACK_MAGIC, sizeof(rh.magic)) &&
+            rh.count <= SCRATCHPAD_ROLLBACK_DEPTH &&
+            fread(rollback_hist, sizeof(rollback_hist[0]), rh.count, fp) == rh.count)
+            n = rh.count;
+        fclose(fp);
+    }
+
+    //the checkpoint is good up to where add_arr starts, or the loaded state if add_arr is empty
+    anchor = k ? &add_arr[0].prev_hi : &current_scratchpad_hi;
+    for (i = 0; i < n; i++)
+        if (!memcmp(&rollback_hist[i].prev_hi, anchor, sizeof(*anchor)))
+            break;
+    if (i == n && n && memcmp(&rh.hi, anchor, sizeof(*anchor)))
+        i = 0;
+    rollback_n = i;
+    for (i = 0; i < k; i++)
+        rollback_push(&add_arr[i]);
+    if (rollback_n)
+        applog(LOG_DEBUG, "rollback history reaches back %zu blocks to height %" PRIu64,
+               rollback_n, rollback_hist[0].prev_hi.height);
+}
+
+/* False if our chain has another block at the height of hi, as far back as the history goes */
+static bool rollback_on_chain(const struct scratchpad_hi *hi)
+{
+    size_t i;
+
+    if (current_scratchpad_hi.height == hi->height)
+        return !memcmp(&current_scratchpad_hi, hi, sizeof(*hi));
+    for (i = rollback_n; i-- > 0; )
+        if (rollback_hist[i].prev_hi.height == hi->height)
+            return !memcmp(&rollback_hist[i].prev_hi, hi, sizeof(*hi));
+    return true;
+}
+
 bool pop_addendum(struct addendums_array_entry* padd_entry)
 {
     if(!padd_entry)
@@ -501,25 +805,54 @@ bool pop_addendum(struct addendums_array_entry* padd_entry)
     patch_scratchpad_with_addendum(scratchpad_size - padd_entry->add_size, &pscratchpad_buff[scratchpad_size - padd_entry->add_size], padd_entry->add_size);
     scratchpad_size = scratchpad_size - padd_entry->add_size;
     memcpy(&current_scratchpad_hi, &padd_entry->prev_hi, sizeof(padd_entry->prev_hi));
+    journal_append(SCRATCHPAD_JOURNAL_POP, padd_entry, NULL);
+    rollback_pop(padd_entry);
 
     memset(padd_entry, 0, sizeof(struct addendums_array_entry));
     return true;
 }
 
+/*
+ * Chain split: the pool's addenda do not continue our scratchpad.  Go back
+ * to a checkpoint height at least ten blocks down, twice as far on every
+ * split in a row, so the pool sends the addenda of its chain from there.
+ * Only with no history left is the whole scratchpad fetched again.
+ */
 bool revert_scratchpad()
 {
-    //playback scratchpad addendums for whole add_arr
-    size_t i_ = 0;
-    size_t i = 0;
-    size_t arr_size = ARRAY_SIZE(add_arr); 
+    uint64_t depth = (uint64_t)WILD_KECCAK_ADDENDUMS_ARRAY_SIZE << (split_attempts < 16 ? split_attempts : 16);
+    uint64_t height = current_scratchpad_hi.height, target = 0, n = 0;
+    struct addendums_array_entry *e;
 
-    for(i_=0; i_ != arr_size; i_++)
+    //jobs broadcast before the pool answers the last rewind say nothing new
+    if (need_to_rerequest_job)
+        return false;
+    if (!split_start_ms)
     {
-        i = arr_size-(i_+1);
-        if(!add_arr[i].prev_hi.height)
-            continue;
-        pop_addendum(&add_arr[i]);
+        split_start_ms = monotonic_ms();
+        split_rewound = 0;
+    }
+    split_attempts++;
+    if (height > depth)
+        target = (height - depth) / SCRATCHPAD_CHECKPOINT_INTERVAL * SCRATCHPAD_CHECKPOINT_INTERVAL;
+    while (current_scratchpad_hi.height > target && (e = newest_addendum()) && pop_addendum(e))
+        n++;
+    //the job being hashed needs the scratchpad as it was
+    stratum_have_work = false;
+    restart_threads();
+    need_to_rerequest_job = true;
+    if (!n)
+    {
+        applog(LOG_ERR, "No rollback history below height %" PRIu64 ", fetching the whole scratchpad", height);
+        reset_scratchpad();
+        split_start_ms = 0;
+        split_attempts = 0;
+        return false;
     }
+    split_rewound += n;
+    applog(LOG_NOTICE, "Rewound %" PRIu64 " blocks to height %" PRIu64 ", %zu more in the rollback history",
+           n, current_scratchpad_hi.height, rollback_n);
+    rollback_checkpoint();
     return true;
 }
 
@@ -543,6 +876,7 @@ bool push_addendum_info(struct scratchpad_hi* pprev_hi, uint64_t size /* uint64
     }
     add_arr[i].prev_hi = *pprev_hi;
     add_arr[i].add_size = size;
+    rollback_push(&add_arr[i]);
 
     return true;
 }
@@ -582,22 +916,25 @@ bool addendum_decode(const json_t *addm)
     {
         if(current_scratchpad_hi.height > hi.height -1)
         {
+            if(!rollback_on_chain(&hi))
+            {
+                applog(LOG_ERR, "addendum with hi.height=%lld is not on our chain, reverting scratchpad", hi.height);
+                revert_scratchpad();
+                return false;
+            }
             //skip low scratchpad
             applog(LOG_ERR, "addendum with hi.height=%lld skipped since current_scratchpad_hi.height=%lld", hi.height, current_scratchpad_hi.height);        
             return true;
         }
-        //TODO: ADD SPLIT HANDLING HERE
         applog(LOG_ERR, "JSON height in addendum-1 (%lld-1) mismatched with current_scratchpad_hi.height(%lld), reverting scratchpad and re-login", hi.height, current_scratchpad_hi.height);
         revert_scratchpad();
-        //re-request job
-        need_to_rerequest_job = true;
         return false;
     }
 
     if(memcmp(prevhash, current_scratchpad_hi.prevhash, 32))
     {
-        //TODO: ADD SPLIT HANDLING HERE
-        applog(LOG_ERR, "JSON prev_id in addendum missmatched with current_scratchpad_hi.prevhash");
+        applog(LOG_ERR, "JSON prev_id in addendum missmatched with current_scratchpad_hi.prevhash, reverting scratchpad");
+        revert_scratchpad();
         return false;
     }
 
@@ -626,11 +963,15 @@ bool addendum_decode(const json_t *addm)
         applog(LOG_ERR, "JSON Failed to apply_addendum!");
         goto err_out;
     }
-    free(padd_buff);
 
+    struct addendums_array_entry entry = {current_scratchpad_hi, add_len/16};
     push_addendum_info(&current_scratchpad_hi, add_len/16);
     uint64_t old_height = current_scratchpad_hi.height;
     current_scratchpad_hi = hi;
+    journal_append(SCRATCHPAD_JOURNAL_ADD, &entry, padd_buff);
+    free(padd_buff);
+    if (current_scratchpad_hi.height % SCRATCHPAD_CHECKPOINT_INTERVAL == 0)
+        rollback_checkpoint();
 
     if (!opt_quiet) {
         applog(LOG_INFO, "ADDENDUM APPLIED: %lld --> %lld  %lld blocks added",
@@ -643,6 +984,82 @@ err_out:
     return false;
 }
 
+#define SHM_FOLLOW_TIMEOUT 3 /* seconds a reader waits for the writer to apply addenda, in the stratum thread */
+
+/*
+ * --scratchpad-shm reader: the writer applies the addenda of a job, wait
+ * until the segment holds exactly the block the last of them leads to and
+ * take its state.  A writer past that block or on another chain leaves
+ * nothing to mine the job with: the miners stop and the job is asked for
+ * again, once per job and writer state so a pool behind the writer is not
+ * asked in a loop.  Takes over when the writer is gone, returning with
+ * shm_writer set and the addenda to apply.
+ */
+static bool shm_follow(const json_t *paddms)
+{
+    static struct scratchpad_hi skipped_target, skipped_state;
+    struct scratchpad_file_header fh = {0};
+    struct scratchpad_hi hi, target = {{0}};
+    bool found = false;
+    int i;
+
+    for (i = 0; i < json_array_size(paddms); i++)
+    {
+        json_t *hi_section = json_object_get(json_array_get(paddms, i), "hi");
+        if (hi_section && parse_height_info(hi_section, &hi) && (!found || hi.height >= target.height))
+        {
+            target = hi;
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        applog(LOG_ERR, "JSON addms without height info");
+        return false;
+    }
+    for (i = 0; i < SHM_FOLLOW_TIMEOUT * 10; i++)
+    {
+        if (shm_read(&fh))
+        {
+            if (!memcmp(&fh.current_hi, &target, sizeof(target)))
+            {
+                shm_adopt(&fh);
+                return true;
+            }
+            if (fh.current_hi.height >= target.height)
+                break; //past the job's block or on another chain, waiting does not help
+        }
+        if (shm_try_promote())
+        {
+            //the cache file and journal are ours now; data left torn is fetched again
+            if (shm_read(&fh))
+            {
+                shm_adopt(&fh);
+                rollback_load();
+                store_scratchpad_to_file(false);
+            }
+            else
+                reset_scratchpad();
+            return true;
+        }
+        usleep(100000);
+    }
+
+    //the data under the miners is the writer's, hashing this job on it only gets shares rejected
+    stratum_have_work = false;
+    restart_threads();
+    if (!memcmp(&skipped_target, &target, sizeof(target)) &&
+        !memcmp(&skipped_state, &fh.current_hi, sizeof(fh.current_hi)))
+        return false;
+    skipped_target = target;
+    skipped_state = fh.current_hi;
+    applog(LOG_ERR, "Scratchpad segment at height %" PRIu64 ", the job needs block %" PRIu64 "%s, re-requesting the job",
+           fh.current_hi.height, target.height,
+           fh.current_hi.height == target.height ? " of another chain" : "");
+    need_to_rerequest_job = true;
+    return false;
+}
+
 bool addendums_decode(const json_t *job)
 {
     json_t* paddms = json_object_get(job, "addms");
@@ -660,19 +1077,44 @@ bool addendums_decode(const json_t *job)
     }
 
     unsigned int add_sz = json_array_size(paddms);
+    bool ok = true;
+    if (!add_sz)
+        return true;
+    if (opt_scratchpad_shm && !shm_writer)
+    {
+        if (!shm_follow(paddms))
+            return false;
+        if (!shm_writer)
+            return true;
+    }
+    scratchpad_begin_update();
     for (int i = 0; i < add_sz; i++) 
     {
         json_t *addm = json_array_get(paddms, i);
         if (!addm ) 
         {
             applog(LOG_ERR, "Internal error: failed to get addm");
-            return false;
+            ok = false;
+            break;
         }
         if(!addendum_decode(addm))
-            return false;
+        {
+            ok = false;
+            break;
+        }
+    }
+    scratchpad_end_update();
+    if (ok && split_start_ms)
+    {
+        applog(LOG_NOTICE, "Chain split handled in %lld ms: rewound %" PRIu64 " blocks, now at height %" PRIu64
+               ", %" PRIu64 " MB of scratchpad not fetched again",
+               monotonic_ms() - split_start_ms, split_rewound, current_scratchpad_hi.height,
+               (uint64_t)scratchpad_size * 8 >> 20);
+        split_start_ms = 0;
+        split_attempts = 0;
     }
 
-    return true;
+    return ok;
 }
 
 bool rpc2_job_decode(const json_t *job, struct work *work) 
@@ -846,7 +1288,8 @@ err_out: return false;
 }
 
 
-bool rpc2_getfullscratchpad_decode(const json_t *val) {
+/* the scratchpad_hex data is already in pscratchpad_buff, len bytes, see stratum_getscratchpad */
+bool rpc2_getfullscratchpad_decode(const json_t *val, size_t len) {
     const char *status;
 
     json_t *res = json_object_get(val, "result");
@@ -867,21 +1310,13 @@ bool rpc2_getfullscratchpad_decode(const json_t *val) {
         goto err_out;
     }
 
-    //parse scratchpad
-    const char* scratch_hex = get_json_string_param(res, "scratchpad_hex");
-    if (!scratch_hex) {
+    //check scratchpad
+    if (!get_json_string_param(res, "scratchpad_hex")) {
         applog(LOG_ERR, "JSON scratch_hex is not a string");
         goto err_out;
     }
 
-    size_t len = hex2bin_len((unsigned char*)pscratchpad_buff, scratch_hex, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
-    if (!len)
-    {
-        applog(LOG_ERR, "JSON scratch_hex is not valid hex");
-        goto err_out;
-    }
-
-    if (len%8 || len%32)
+    if (!len || len%8 || len%32)
     {
         applog(LOG_ERR, "JSON scratch_hex is not valid size=%d bytes", len);
         goto err_out;
@@ -901,8 +1336,11 @@ bool rpc2_getfullscratchpad_decode(const json_t *val) {
         goto err_out;
     }
 
+    if (!numa_commit_replicas(len))
+        goto err_out;
     applog(LOG_INFO, "Fetched scratchpad size %d bytes", len);
     scratchpad_size = len/8;
+    numa_sync_replicas(0, scratchpad_size);
 
     return true;
 
@@ -929,7 +1367,8 @@ static void share_result(int result, struct work *work, const char *reason) {
         applog(LOG_DEBUG, "DEBUG: reject reason: %s", reason);
 }
 
-static bool submit_upstream_work(CURL *curl, struct work *work) {
+/* hash is the one scanhash found for the nonce in work, or NULL */
+static bool submit_upstream_work(CURL *curl, struct work *work, const uint32_t *hash_in) {
     char *str = NULL;
     json_t *val, *res, *reason;
     char s[JSON_BUF_LEN];
@@ -955,7 +1394,10 @@ static bool submit_upstream_work(CURL *curl, struct work *work) {
 
             noncestr = bin2hex(((const unsigned char*)work->data) + 1, 8);
             strcpy(last_found_nonce, noncestr);
-            wild_keccak_hash_dbl_use_global_scratch((uint8_t*)work->data, work->job_len, (uint8_t*)hash);                
+            if (hash_in)
+                memcpy(hash, hash_in, 32);
+            else
+                wild_keccak_hash_dbl_use_global_scratch((uint8_t*)work->data, work->job_len, (uint8_t*)hash);                
             hashhex = bin2hex(hash, 32);
             snprintf(s, JSON_BUF_LEN,
                 "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":1}\r\n",
@@ -988,7 +1430,10 @@ static bool submit_upstream_work(CURL *curl, struct work *work) {
 
             noncestr = bin2hex(((const unsigned char*)work->data) + 1, 8);
             strcpy(last_found_nonce, noncestr);
-            wild_keccak_hash_dbl_use_global_scratch((uint8_t*)work->data, work->job_len, (uint8_t*)hash);
+            if (hash_in)
+                memcpy(hash, hash_in, 32);
+            else
+                wild_keccak_hash_dbl_use_global_scratch((uint8_t*)work->data, work->job_len, (uint8_t*)hash);
             hashhex = bin2hex(hash, 32);
             snprintf(s, JSON_BUF_LEN,
                 "{\"method\": \"submit\", \"params\": {\"id\": \"%s\", \"job_id\": \"%s\", \"nonce\": \"%s\", \"result\": \"%s\"}, \"id\":1}\r\n",
@@ -1140,15 +1585,6 @@ static void workio_cmd_free(struct workio_cmd *wc) {
     if (!wc)
         return;
 
-    switch (wc->cmd) {
-    case WC_SUBMIT_WORK:
-        work_free(wc->u.work);
-        free(wc->u.work);
-        break;
-    default: /* do nothing */
-        break;
-    }
-
     memset(wc, 0, sizeof(*wc)); /* poison */
     free(wc);
 }
@@ -1180,11 +1616,31 @@ static bool workio_get_work(struct workio_cmd *wc, CURL *curl) {
     return true;
 }
 
-static bool workio_submit_work(struct workio_cmd *wc, CURL *curl) {
+static struct work_ref *work_ref_new(const struct work *work) {
+    struct work_ref *ref = xmalloc(sizeof(*ref));
+
+    ref->work = xmalloc(sizeof(*ref->work));
+    work_copy(ref->work, work);
+    ref->refs = 1;
+    return ref;
+}
+
+static void work_ref_put(struct work_ref *ref) {
+    if (!ref || __atomic_sub_fetch(&ref->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    work_free(ref->work);
+    free(ref->work);
+    free(ref);
+}
+
+static bool workio_submit_result(CURL *curl, const struct scan_result *res) {
+    struct work work = *res->job->work;
     int failures = 0;
 
+    memcpy(((uint8_t*)work.data) + 1, &res->nonce, 8);
+
     /* submit solution to bitcoin via JSON-RPC */
-    while (!submit_upstream_work(curl, wc->u.work)) {
+    while (!submit_upstream_work(curl, &work, res->hash)) {
         if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
             applog(LOG_ERR, "...terminating workio thread");
             return false;
@@ -1198,6 +1654,36 @@ static bool workio_submit_work(struct workio_cmd *wc, CURL *curl) {
     return true;
 }
 
+/* Submits every share in the ring; the miner thread keeps hashing meanwhile */
+static bool workio_submit_results(struct workio_cmd *wc, CURL *curl) {
+    struct scan_result res;
+    bool ok = true;
+
+    while (ok && result_ring_pop(wc->u.ring, &res)) {
+        ok = workio_submit_result(curl, &res);
+        work_ref_put(res.job);
+    }
+
+    return ok;
+}
+
+/* Submits the shares in every ring, then tells the waiting thread */
+static bool workio_flush_results(struct workio_cmd *wc, CURL *curl) {
+    struct scan_result res;
+    bool ok = true;
+    int i;
+
+    for (i = 0; ok && i < opt_n_threads; i++) {
+        while (ok && result_ring_pop(&result_rings[i], &res)) {
+            ok = workio_submit_result(curl, &res);
+            work_ref_put(res.job);
+        }
+    }
+    tq_push(wc->u.done, wc->u.done);
+
+    return ok;
+}
+
 static bool workio_login(CURL *curl) {
     int failures = 0;
 
@@ -1255,8 +1741,11 @@ static void *workio_thread(void *userdata) {
         case WC_GET_WORK:
             ok = workio_get_work(wc, curl);
             break;
-        case WC_SUBMIT_WORK:
-            ok = workio_submit_work(wc, curl);
+        case WC_SUBMIT_RESULTS:
+            ok = workio_submit_results(wc, curl);
+            break;
+        case WC_FLUSH_RESULTS:
+            ok = workio_flush_results(wc, curl);
             break;
 
         default: /* should never happen */
@@ -1310,27 +1799,17 @@ static bool get_work(struct thr_info *thr, struct work *work) {
     return true;
 }
 
-static bool submit_work(struct thr_info *thr, const struct work *work_in) {
+/* Wakes the workio thread to submit the shares in ring */
+static void submit_results(struct result_ring *ring) {
     struct workio_cmd *wc;
 
-    /* fill out work request message */
     wc = xcalloc(1, sizeof(*wc));
-    wc->u.work = xmalloc(sizeof(*work_in));
-    if (!wc->u.work)
-        goto err_out;
+    wc->cmd = WC_SUBMIT_RESULTS;
+    wc->u.ring = ring;
 
-    wc->cmd = WC_SUBMIT_WORK;
-    wc->thr = thr;
-    work_copy(wc->u.work, work_in);
-
-    /* send solution to workio thread */
+    /* a frozen queue means the workio thread is gone */
     if (!tq_push(thr_info[work_thr_id].q, wc))
-        goto err_out;
-
-    return true;
-
-err_out: workio_cmd_free(wc);
-    return false;
+        workio_cmd_free(wc);
 }
 
 static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work) {
@@ -1341,12 +1820,44 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work) {
     pthread_mutex_unlock(&sctx->work_lock);
 }
 
+static long long monotonic_ms(void)
+{
+#ifdef WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Called by the miner threads until one of them gets here; logs how long startup took */
+static void log_first_hash(void)
+{
+    long long now;
+
+    if (__atomic_exchange_n(&first_hash_seen, true, __ATOMIC_RELAXED))
+        return;
+    now = monotonic_ms();
+    applog(LOG_NOTICE, "Time to first hash: %lld ms, scratchpad ready after %lld ms",
+           now - start_ms, scratchpad_ready_ms - start_ms);
+    if (hot_restart_ms)
+        applog(LOG_NOTICE, "Hot restart: hashing again %lld ms after the handoff", now - hot_restart_ms);
+}
+
 static void *miner_thread(void *userdata) {
     struct thr_info *mythr = userdata;
     int thr_id = mythr->id;
     struct work work = { { 0 } };
+    struct wk_midstate mid;
+    struct result_ring *ring = opt_benchmark ? NULL : &result_rings[thr_id];
     uint32_t max_nonce;
-    uint32_t end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - 0x20;
+    /* the high half of the 64-bit nonce splits the space between threads,
+     * scanhash walks the low half; lanes hash consecutive low halves */
+    const uint32_t end_nonce = 0xffffffffU - 0x20;
+    const uint32_t hi_first = (uint32_t)(((uint64_t)thr_id << 32) / opt_n_threads);
+    const uint32_t hi_last = (uint32_t)((((uint64_t)thr_id + 1) << 32) / opt_n_threads - 1);
     char s[16];
     int i;
 
@@ -1360,7 +1871,13 @@ static void *miner_thread(void *userdata) {
 
     /* Cpu affinity only makes sense if the number of threads is a multiple
     * of the number of CPUs */
-    if (num_processors > 1 && opt_n_threads % num_processors == 0) {
+    if (numa_nodes) {
+        if (!opt_quiet) {
+            applog(LOG_INFO, "Binding thread %d to NUMA node %d",
+                   thr_id, numa_node_id(numa_thread_node(thr_id)));
+        }
+        numa_bind_thread(thr_id);
+    } else if (num_processors > 1 && opt_n_threads % num_processors == 0) {
         if (!opt_quiet) {
             applog(LOG_INFO, "Binding thread %d to cpu %d",
                    thr_id, thr_id % num_processors);
@@ -1368,8 +1885,14 @@ static void *miner_thread(void *userdata) {
         affine_to_cpu(thr_id, thr_id % num_processors);
     }
 
-    uint32_t *nonceptr = (uint32_t*) (((char*)work.data) + (jsonrpc_2 ? 39 : 76));
-    nonceptr = (uint32_t*) (((char*)work.data) + 1);
+    uint32_t *nonceptr = (uint32_t*) (((char*)work.data) + 1);
+    uint32_t *nonce_hi = (uint32_t*) (((char*)work.data) + 5);
+    /* work.data past the nonce only changes with the job */
+    wild_keccak_midstate_init(&mid, (const uint8_t*)work.data, 81);
+    if (ring) {
+        ring->notify = submit_results;
+        ring->job = work_ref_new(&work);
+    }
 
     //boolberry job 01000000000000000009048cc3ccbbf6de2095ac436ad08dfa2a42654e866c40bb26bde37baacf300900d684c69d0501ef58fd3722b8cf3068814c5f60fa16b75a13282270c1ece90d7939627708d43a01
     while (1) {
@@ -1384,7 +1907,7 @@ static void *miner_thread(void *userdata) {
                 sleep(1);
             }
             pthread_mutex_lock(&g_work_lock);
-            if ((*nonceptr) >= end_nonce && !(jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 1 + 8,
+            if ((*nonceptr) >= end_nonce && *nonce_hi >= hi_last && !(jsonrpc_2 ? memcmp(((uint8_t*) work.data) + 1 + 8,
                                             ((uint8_t*) g_work.data) + 1 + 8, 80-9) :
                                             memcmp(work.data, g_work.data, 80))) {
                 stratum_gen_work(&stratum, &g_work);
@@ -1394,7 +1917,7 @@ static void *miner_thread(void *userdata) {
             pthread_mutex_lock(&g_work_lock);
             if ((!have_stratum && (!have_longpoll ||
                  time(NULL ) >= g_work_time + LP_SCANTIME * 3 / 4 ||
-                 *nonceptr >= end_nonce))) {
+                 (*nonceptr >= end_nonce && *nonce_hi >= hi_last)))) {
                 if (unlikely(!get_work(mythr, &g_work))) {
                     applog(LOG_ERR, "work retrieval failed, exiting "
                            "mining thread %d", mythr->id);
@@ -1411,8 +1934,21 @@ static void *miner_thread(void *userdata) {
         if (memcmp(((uint8_t*) work.data) + 1 + 8, ((uint8_t*) g_work.data) + 1 + 8, 80-9)) {
             work_free(&work);
             work_copy(&work, &g_work);
-            nonceptr = (uint32_t*) (((char*)work.data) + 1);
-            *nonceptr = 0xffffffffU / opt_n_threads * thr_id;
+            *nonceptr = 0;
+            *nonce_hi = hi_first;
+            /* blobs are at most 128 bytes, so always a single block */
+            wild_keccak_midstate_init(&mid, (const uint8_t*)work.data, work.job_len ? work.job_len : 81);
+            /* shares of the old job still in the ring keep their own reference */
+            if (ring) {
+                work_ref_put(ring->job);
+                ring->job = work_ref_new(&work);
+            }
+        } else if (*nonceptr >= end_nonce) {
+            /* low half used up: the next 2^32 nonces of the slice, whose
+             * high half is hashed into the midstate */
+            *nonceptr = 0;
+            *nonce_hi = *nonce_hi < hi_last ? *nonce_hi + 1 : hi_first;
+            wild_keccak_midstate_init(&mid, (const uint8_t*)work.data, work.job_len ? work.job_len : 81);
         } else {
             ++(*nonceptr);
         }
@@ -1435,15 +1971,17 @@ static void *miner_thread(void *userdata) {
             max_nonce = *nonceptr + max64;
 
         if (!opt_quiet) {
-            applog(LOG_INFO, "Thread %d is going to scan with start nonce=%08x, end_nonce=%08x",
-                   thr_id, *nonceptr, max_nonce);
+            applog(LOG_INFO, "Thread %d is going to scan with start nonce=%08x%08x, end_nonce=%08x%08x",
+                   thr_id, *nonce_hi, *nonceptr, *nonce_hi, max_nonce);
         }
 
         hashes_done = 0;
+        if (!first_hash_seen)
+            log_first_hash();
         gettimeofday(&tv_start, NULL );
 
         /* scan nonces for a proof-of-work hash */
-        rc = scanhash_wildkeccak(thr_id, work.data, work.target, max_nonce, &hashes_done);
+        rc = scanhash_wildkeccak(thr_id, work.data, &mid, work.target, max_nonce, &hashes_done, ring);
 
         /* record scanhash elapsed time */
         gettimeofday(&tv_end, NULL );
@@ -1455,8 +1993,10 @@ static void *miner_thread(void *userdata) {
             pthread_mutex_unlock(&stats_lock);
         }
         if (!opt_quiet) {
-                applog(LOG_INFO, "thread %d: %lu hashes, %.2f kh/s",
-                       thr_id, hashes_done, 1e-3 * thr_hashrates[thr_id]);
+                applog(LOG_INFO, "thread %d: %lu hashes, %.2f kh/s (%s, %d lanes, prefetch %d/%d)",
+                       thr_id, hashes_done, 1e-3 * thr_hashrates[thr_id],
+                       wild_keccak_kernel_name(), opt_lanes,
+                       opt_prefetch_distance, opt_prefetch_hint);
         }
         if (opt_benchmark && thr_id == opt_n_threads - 1) {
             double hashrate = 0.;
@@ -1467,10 +2007,18 @@ static void *miner_thread(void *userdata) {
                 applog(LOG_INFO, "Total: %s khash/s", s);
             }
         }
+        if (numa_nodes && !opt_quiet && thr_id == opt_n_threads - 1) {
+            for (int node = 0; node < numa_nodes; node++) {
+                double hashrate = 0.;
+                for (i = 0; i < opt_n_threads; i++)
+                    if (numa_thread_node(i) == node)
+                        hashrate += thr_hashrates[i];
+                applog(LOG_INFO, "NUMA node %d: %.2f kh/s", numa_node_id(node), 1e-3 * hashrate);
+            }
+        }
 
-        /* if nonce found, submit work */
-        if (rc && !opt_benchmark && !submit_work(mythr, &work))
-            break;
+        if (rc && opt_debug)
+            applog(LOG_DEBUG, "DEBUG: thread %d queued %d shares", thr_id, rc);
     }
 
 out: tq_freeze(mythr->q);
@@ -1590,41 +2138,286 @@ out:
     return NULL;
 }
 
-bool store_scratchpad_to_file(bool do_fsync)
+#if !defined(_WIN64) && !defined(_WIN32)
+static bool commit_mapped_scratchpad(void);
+#endif
+
+/*
+ * Scratchpad journal.  Rewriting the whole cache file for every block
+ * would mean hundreds of MB of writes, so the file is only rewritten every
+ * 12 hours and each addendum applied or popped in between is appended to
+ * <cache>.journal instead.  Loading the cache file replays the journal on
+ * top of it, and every store starts a new empty journal keyed by the
+ * current_hi of the file just written.
+ */
+#define FNV1A64_BASIS  0xcbf29ce484222325ULL
+
+static uint64_t fnv1a64(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *c = p;
+
+    while (len--)
+        h = (h ^ *c++) * 0x100000001b3ULL;
+    return h;
+}
+
+static void journal_name(char *buf, size_t len)
 {
+    snprintf(buf, len, "%s.journal", pscratchpad_local_cache);
+}
+
+static bool journal_reset(void)
+{
+    char fname[PATH_MAX], tmp[PATH_MAX + 4];
+    struct scratchpad_journal_header jh = {SCRATCHPAD_JOURNAL_MAGIC};
     FILE *fp;
-    char file_name_buff[PATH_MAX];  
-    int ret;
 
-    if(!scratchpad_size) return true;
+    if (journal_fp)
+        fclose(journal_fp);
+    journal_fp = NULL;
+    journal_bytes = 0;
 
-    snprintf(file_name_buff, sizeof(file_name_buff), "%s.tmp", pscratchpad_local_cache);
-    unlink(file_name_buff);
-    fp = fopen(file_name_buff, "wbx");
-    if(fp == NULL)
+    jh.base_hi = current_scratchpad_hi;
+    journal_name(fname, sizeof(fname));
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp))
     {
-        applog(LOG_INFO, "failed to create file %s: %s", file_name_buff, strerror(errno));
+        applog(LOG_ERR, "scratchpad journal path %s is too long", fname);
+        return false;
+    }
+    fp = fopen(tmp, "wb");
+    if (fp == NULL)
+    {
+        applog(LOG_ERR, "failed to create file %s: %s", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(&jh, sizeof(jh), 1, fp) == 1;
+    if (fclose(fp) == EOF)
+        ok = false;
+    if (!ok || rename(tmp, fname) == -1)
+    {
+        applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+        unlink(tmp);
         return false;
     }
+    journal_fp = fopen(fname, "ab");
+    journal_bytes = sizeof(jh);
+    return journal_fp != NULL;
+}
 
-    struct scratchpad_file_header sf = {0};
-    memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
-    sf.current_hi = current_scratchpad_hi;
-    sf.scratchpad_size = scratchpad_size;
+static void journal_append(uint32_t type, const struct addendums_array_entry *entry, const uint64_t *data)
+{
+    struct scratchpad_journal_record rec = {0};
+    size_t words = type == SCRATCHPAD_JOURNAL_ADD ? entry->add_size : 0;
+
+    //not open while the journal itself is replayed, nor with --scratchpad-mmap
+    if (!journal_fp)
+        return;
 
+    rec.type = type;
+    rec.entry = *entry;
+    rec.hi = current_scratchpad_hi;
+    rec.checksum = fnv1a64(fnv1a64(FNV1A64_BASIS, &rec, sizeof(rec)), data, words * 8);
+    if ((fwrite(&rec, sizeof(rec), 1, journal_fp) != 1) ||
+        (fwrite(data, 8, words, journal_fp) != words) ||
+        fflush(journal_fp))
+    {
+        applog(LOG_ERR, "failed to append to scratchpad journal: %s", strerror(errno));
+        fclose(journal_fp);
+        journal_fp = NULL;
+        //have the stratum thread rewrite the cache file
+        journal_bytes = SCRATCHPAD_JOURNAL_COMPACT_SIZE + 1;
+        return;
+    }
+    journal_bytes += sizeof(rec) + words * 8;
+}
 
+/* Redoes one journal record; it has to continue from the current state */
+static bool journal_apply(struct scratchpad_journal_record *rec, uint64_t *data)
+{
+    struct addendums_array_entry *e;
 
-    if ((fwrite(&sf, sizeof(sf), 1, fp) != 1) ||
-        (fwrite(pscratchpad_buff, 8, scratchpad_size, fp) != scratchpad_size)) {
-            applog(LOG_ERR, "failed to write file %s: %s", file_name_buff, strerror(errno));
-            fclose(fp);
-            unlink(file_name_buff);
+    if (rec->type == SCRATCHPAD_JOURNAL_ADD)
+    {
+        if (memcmp(&rec->entry.prev_hi, &current_scratchpad_hi, sizeof(current_scratchpad_hi)) ||
+            !apply_addendum(data, rec->entry.add_size))
             return false;
+        push_addendum_info(&current_scratchpad_hi, rec->entry.add_size);
+        current_scratchpad_hi = rec->hi;
+        return true;
     }
-    fflush(fp);
-    /*if (do_fsync) {
-        if (fsync(fileno(fp)) == -1) {
-            applog(LOG_ERR, "failed to fsync file %s: %s", file_name_buff, strerror(errno));
+    if (rec->type != SCRATCHPAD_JOURNAL_POP)
+        return false;
+    e = newest_addendum();
+    if (!e || memcmp(e, &rec->entry, sizeof(rec->entry)))
+        return false;
+    return pop_addendum(e);
+}
+
+/*
+ * Replays the journal over a freshly loaded cache file.  Returns false if
+ * there is no journal for this file; *torn is set if replay stopped short
+ * at a record that was cut off, corrupt or out of sequence.
+ */
+static bool journal_replay(bool *torn)
+{
+    char fname[PATH_MAX];
+    struct scratchpad_journal_header jh;
+    struct scratchpad_journal_record rec;
+    uint64_t *data = NULL, h, sum;
+    size_t words;
+    long end;
+    unsigned n = 0;
+    FILE *fp;
+
+    journal_name(fname, sizeof(fname));
+    fp = fopen(fname, "rb");
+    if (fp == NULL)
+        return false;
+    if ((fread(&jh, sizeof(jh), 1, fp) != 1) ||
+        memcmp(jh.magic, SCRATCHPAD_JOURNAL_MAGIC, sizeof(jh.magic)) ||
+        memcmp(&jh.base_hi, &current_scratchpad_hi, sizeof(jh.base_hi)))
+    {
+        fclose(fp);
+        return false;
+    }
+
+    end = sizeof(jh);
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        words = rec.type == SCRATCHPAD_JOURNAL_ADD ? rec.entry.add_size : 0;
+        if (words % 4 || (scratchpad_size + words) * 8 >= WILD_KECCAK_SCRATCHPAD_BUFFSIZE)
+            break;
+        if (words)
+        {
+            data = xrealloc(data, words, 8);
+            if (fread(data, 8, words, fp) != words)
+                break;
+        }
+        sum = rec.checksum;
+        rec.checksum = 0;
+        h = fnv1a64(fnv1a64(FNV1A64_BASIS, &rec, sizeof(rec)), data, words * 8);
+        if (h != sum || !journal_apply(&rec, data))
+            break;
+        end += sizeof(rec) + words * 8;
+        n++;
+    }
+    fseek(fp, 0, SEEK_END);
+    *torn = ftell(fp) != end;
+    fclose(fp);
+    free(data);
+
+    journal_bytes = end;
+    if (n)
+        applog(LOG_INFO, "replayed %u scratchpad journal records, height=%" PRIu64,
+               n, current_scratchpad_hi.height);
+    if (*torn)
+        applog(LOG_NOTICE, "scratchpad journal %s ends in a damaged record, discarding it", fname);
+    return true;
+}
+
+#define SCRATCHPAD_SAVE_THREADS 4 /* keeps an NVMe queue busy without stalling many miners */
+
+/* Header, extension and data in the cache file layout, kept out of the page cache */
+static bool write_scratchpad(FILE *fp, const char *fname)
+{
+    struct scratchpad_file_header sf = {0};
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, 0};
+    memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
+    sf.current_hi = current_scratchpad_hi;
+    sf.scratchpad_size = scratchpad_size;
+
+#if !defined(_WIN64) && !defined(_WIN32)
+    struct spio io = {
+        .fd = fileno(fp), .name = fname, .offset = SCRATCHPAD_FILE_DATA_OFFSET,
+        .buf = (uint8_t *)pscratchpad_buff, .bytes = scratchpad_size * 8,
+        .threads = SCRATCHPAD_SAVE_THREADS, .uncached = true,
+    };
+    struct scratchpad_file_sums sh = {SCRATCHPAD_FILE_CHUNK, 0};
+    off_t sums_pos = sizeof(sf) + sizeof(ext);
+
+    sh.chunks = (io.bytes + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    //a scratchpad past what the header area can list goes without checksums
+    if (sh.chunks <= SCRATCHPAD_FILE_MAX_CHUNKS)
+    {
+        io.sums = xmalloc(sh.chunks * 8);
+        ext.flags |= SCRATCHPAD_FILE_CHECKSUMS;
+    }
+
+    if ((fwrite(&sf, sizeof(sf), 1, fp) != 1) ||
+        (fwrite(&ext, sizeof(ext), 1, fp) != 1) ||
+        fflush(fp)) {
+            applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+            free(io.sums);
+            return false;
+    }
+    if (!spio_write(&io)) {
+            free(io.sums);
+            return false;
+    }
+    if (io.sums && (pwrite(io.fd, &sh, sizeof(sh), sums_pos) != sizeof(sh) ||
+        pwrite(io.fd, io.sums, sh.chunks * 8, sums_pos + sizeof(sh)) != (ssize_t)(sh.chunks * 8))) {
+            applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+            free(io.sums);
+            return false;
+    }
+    free(io.sums);
+    spio_report("Wrote", &io);
+#else
+    if ((fwrite(&sf, sizeof(sf), 1, fp) != 1) ||
+        (fwrite(&ext, sizeof(ext), 1, fp) != 1) ||
+        fseek(fp, SCRATCHPAD_FILE_DATA_OFFSET, SEEK_SET) ||
+        (fwrite(pscratchpad_buff, 8, scratchpad_size, fp) != scratchpad_size)) {
+            applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+            return false;
+    }
+#endif
+    return true;
+}
+
+static void scratchpad_seq_end(void)
+{
+    if (scratchpad_seq & 1)
+        __atomic_store_n(&scratchpad_seq, scratchpad_seq + 1, __ATOMIC_RELEASE);
+}
+
+bool store_scratchpad_to_file(bool do_fsync)
+{
+    FILE *fp;
+    char file_name_buff[PATH_MAX];  
+    int ret;
+
+    //ends the update stratum_getscratchpad began
+    scratchpad_seq_end();
+    if(opt_scratchpad_shm)
+    {
+        //the cache file is the writer's to keep
+        if(!shm_writer) return true;
+        shm_publish_state();
+    }
+#if !defined(_WIN64) && !defined(_WIN32)
+    //the mapped file already holds the data, only the header is behind
+    if(scratchpad_fd >= 0) return commit_mapped_scratchpad();
+#endif
+    if(!scratchpad_size) return true;
+
+    snprintf(file_name_buff, sizeof(file_name_buff), "%s.tmp", pscratchpad_local_cache);
+    unlink(file_name_buff);
+    fp = fopen(file_name_buff, "wbx");
+    if(fp == NULL)
+    {
+        applog(LOG_INFO, "failed to create file %s: %s", file_name_buff, strerror(errno));
+        return false;
+    }
+
+    if (!write_scratchpad(fp, file_name_buff)) {
+            fclose(fp);
+            unlink(file_name_buff);
+            return false;
+    }
+    fflush(fp);
+    /*if (do_fsync) {
+        if (fsync(fileno(fp)) == -1) {
+            applog(LOG_ERR, "failed to fsync file %s: %s", file_name_buff, strerror(errno));
             fclose(fp);
             unlink(file_name_buff);
             return false;
@@ -1635,81 +2428,1125 @@ bool store_scratchpad_to_file(bool do_fsync)
         unlink(file_name_buff);
         return false;
     }
-    ret = rename(file_name_buff, pscratchpad_local_cache);
-    if (ret == -1) {
-        applog(LOG_ERR, "failed to rename %s to %s: %s",
-            file_name_buff, pscratchpad_local_cache, strerror(errno));
-        unlink(file_name_buff);
+    ret = rename(file_name_buff, pscratchpad_local_cache);
+    if (ret == -1) {
+        applog(LOG_ERR, "failed to rename %s to %s: %s",
+            file_name_buff, pscratchpad_local_cache, strerror(errno));
+        unlink(file_name_buff);
+        return false;
+    }
+    applog(LOG_DEBUG, "saved scratchpad to %s (%zu+%zu bytes)", pscratchpad_local_cache,
+        sizeof(struct scratchpad_file_header), (size_t)scratchpad_size * 8);
+    //everything journaled so far is in the file now
+    journal_reset();
+    return true;
+}
+
+static bool scratchpad_file_fresh(const char *fname)
+{
+    struct stat file_stat;
+    if(stat(fname, &file_stat) < 0)    
+    {
+        applog(LOG_ERR, "fstat error from %s: %s", fname, strerror(errno));
+        return false;
+    }
+    if(time(NULL) - file_stat.st_mtime > LOCAL_SCRATCHPAD_CACHE_EXPIRATION_INTERVAL)
+    {
+        applog(LOG_NOTICE, "Scratchpad file is too old %s", fname);
+        return false;
+    }
+    return true;
+}
+
+/* Reads the header of a scratchpad file in either layout and leaves fp at the data */
+static bool read_scratchpad_file_header(FILE *fp, const char *fname, struct scratchpad_file_header *fh, uint64_t *data_offset)
+{
+    struct scratchpad_file_ext ext;
+
+    if ((fread(fh, sizeof(*fh), 1, fp) != 1))
+    {
+        applog(LOG_ERR, "read error from %s: %s", fname, strerror(errno));
+        return false;
+    }
+
+    if ((fh->scratchpad_size*8 > (WILD_KECCAK_SCRATCHPAD_BUFFSIZE)) ||(fh->scratchpad_size%4)) 
+    {
+        applog(LOG_ERR, "file %s size invalid (%" PRIu64 "), max=%zu",
+            fname, fh->scratchpad_size*8, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
+        return false;
+    }
+
+    *data_offset = sizeof(*fh);
+    if (fread(&ext, sizeof(ext), 1, fp) == 1 && !memcmp(ext.magic, SCRATCHPAD_FILE_MAGIC, sizeof(ext.magic)))
+    {
+        if (ext.flags & SCRATCHPAD_FILE_DIRTY)
+        {
+            applog(LOG_NOTICE, "Scratchpad file %s was not closed cleanly", fname);
+            return false;
+        }
+        *data_offset = ext.data_offset;
+    }
+    if (fseek(fp, *data_offset, SEEK_SET))
+    {
+        applog(LOG_ERR, "seek error in %s: %s", fname, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#if !defined(_WIN64) && !defined(_WIN32)
+/*
+ * Loader thread idx runs on the CPU the miner thread with the same number
+ * binds to, so first-touch placement puts its share of the scratchpad there.
+ */
+static void scratchpad_loader_bind(int idx)
+{
+    if (num_processors > 1 && opt_n_threads % num_processors == 0)
+        affine_to_cpu(idx, idx % num_processors);
+}
+
+/*
+ * Reads words of data at offset of fd into pscratchpad_buff, one thread per
+ * miner thread, and the checksum of every chunk into sums if that is set.
+ */
+static bool scratchpad_fill(int fd, const char *fname, uint64_t offset, uint64_t words, uint64_t *sums)
+{
+    struct spio io = {
+        .fd = fd, .name = fname, .offset = offset,
+        .buf = (uint8_t *)pscratchpad_buff, .bytes = words * 8,
+        .threads = opt_n_threads, .uncached = true,
+        .thread_init = scratchpad_loader_bind, .sums = sums,
+    };
+
+    if (!spio_read(&io))
+        return false;
+    spio_report("Read", &io);
+    return true;
+}
+
+/* The checksum table of a file written with one, NULL if it has none */
+static uint64_t *read_scratchpad_sums(int fd, const char *fname, uint64_t words)
+{
+    struct scratchpad_file_ext ext;
+    struct scratchpad_file_sums hdr;
+    uint64_t chunks = (words * 8 + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    off_t pos = sizeof(struct scratchpad_file_header);
+    uint64_t *sums;
+
+    if (pread(fd, &ext, sizeof(ext), pos) != sizeof(ext) ||
+        memcmp(ext.magic, SCRATCHPAD_FILE_MAGIC, sizeof(ext.magic)) ||
+        !(ext.flags & SCRATCHPAD_FILE_CHECKSUMS))
+        return NULL;
+    pos += sizeof(ext);
+    if (pread(fd, &hdr, sizeof(hdr), pos) != sizeof(hdr) ||
+        hdr.chunk_size != SCRATCHPAD_FILE_CHUNK || hdr.chunks != chunks)
+    {
+        applog(LOG_NOTICE, "Scratchpad file %s has a checksum table that does not fit it", fname);
+        return NULL;
+    }
+    sums = xmalloc(chunks * 8);
+    if (pread(fd, sums, chunks * 8, pos + sizeof(hdr)) != (ssize_t)(chunks * 8))
+    {
+        free(sums);
+        return NULL;
+    }
+    return sums;
+}
+
+struct range_buf {
+    uint8_t *p;
+    size_t len;
+    size_t got;
+};
+
+static size_t range_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    struct range_buf *rb = userdata;
+    size_t n = size * nmemb;
+
+    if (n > rb->len - rb->got)
+        return 0; //more than asked for, e.g. a server that ignored the range
+    memcpy(rb->p + rb->got, ptr, n);
+    rb->got += n;
+    return n;
+}
+
+/* Fetches len bytes at from of url into buf, which must come as a partial response */
+static bool http_range(CURL *curl, const char *url, uint64_t from, void *buf, size_t len)
+{
+    struct range_buf rb = {buf, len, 0};
+    char range[64];
+    long code = 0;
+    CURLcode res;
+
+    snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, from, from + len - 1);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, range_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rb);
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    return res == CURLE_OK && code == 206 && rb.got == len;
+}
+
+/*
+ * The header of the scratchpad file at url.  A file served for download has
+ * no extension, ext then gets the data offset it implies and no flags.
+ */
+static bool http_scratchpad_head(CURL *curl, const char *url, struct scratchpad_file_header *fh,
+                                 struct scratchpad_file_ext *ext)
+{
+    uint8_t head[sizeof(*fh) + sizeof(*ext)];
+
+    if (!http_range(curl, url, 0, head, sizeof(head)))
+        return false;
+    memcpy(fh, head, sizeof(*fh));
+    memcpy(ext, head + sizeof(*fh), sizeof(*ext));
+    if (memcmp(ext->magic, SCRATCHPAD_FILE_MAGIC, sizeof(ext->magic)))
+    {
+        ext->data_offset = sizeof(*fh);
+        ext->flags = 0;
+    }
+    return true;
+}
+
+/*
+ * Fetches the damaged chunks of a cache file from the scratchpad URL with
+ * range requests and writes them back.  That only works while the file
+ * there holds the same blockchain height as ours, a peer more often than
+ * the pool's snapshot; otherwise the caller downloads everything.
+ */
+static bool scratchpad_repair(const char *fname, uint64_t data_offset, const struct scratchpad_file_header *fh,
+                              const uint64_t *want, const uint64_t *got)
+{
+    struct scratchpad_file_header rfh;
+    struct scratchpad_file_ext rext;
+    char curl_error_buff[CURL_ERROR_SIZE] = {0};
+    uint64_t bytes = fh->scratchpad_size * 8;
+    uint64_t chunks = (bytes + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    uint64_t remote_offset, c, bad = 0, fixed = 0;
+    CURL *curl;
+    int fd;
+
+    if (!pscratchpad_url)
+        return false;
+    curl = curl_easy_init();
+    if (!curl)
+        return false;
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buff);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    if (!http_scratchpad_head(curl, pscratchpad_url, &rfh, &rext) ||
+        rfh.scratchpad_size != fh->scratchpad_size ||
+        memcmp(&rfh.current_hi, &fh->current_hi, sizeof(fh->current_hi)))
+    {
+        applog(LOG_NOTICE, "No partial repair from %s: %s", pscratchpad_url,
+               curl_error_buff[0] ? curl_error_buff : "not our scratchpad height or server without ranges");
+        curl_easy_cleanup(curl);
+        return false;
+    }
+    remote_offset = rext.data_offset;
+
+    fd = open(fname, O_WRONLY | O_CLOEXEC);
+    for (c = 0; c < chunks; c++)
+    {
+        uint64_t pos = c * SCRATCHPAD_FILE_CHUNK;
+        size_t len = pos + SCRATCHPAD_FILE_CHUNK < bytes ? SCRATCHPAD_FILE_CHUNK : bytes - pos;
+        uint8_t *p = (uint8_t *)pscratchpad_buff + pos;
+
+        if (want[c] == got[c])
+            continue;
+        bad++;
+        if (!http_range(curl, pscratchpad_url, remote_offset + pos, p, len) || spio_sum(p, len) != want[c])
+        {
+            applog(LOG_ERR, "chunk %" PRIu64 " of %s from %s does not match: %s",
+                   c, fname, pscratchpad_url, curl_error_buff);
+            continue;
+        }
+        if (fd < 0 || pwrite(fd, p, len, data_offset + pos) != (ssize_t)len)
+        {
+            applog(LOG_ERR, "failed to write file %s: %s", fname, strerror(errno));
+            continue;
+        }
+        fixed++;
+    }
+    if (fd >= 0)
+        close(fd);
+    curl_easy_cleanup(curl);
+    applog(fixed == bad ? LOG_INFO : LOG_ERR, "Repaired %" PRIu64 " of %" PRIu64 " damaged chunks of %s",
+           fixed, bad, fname);
+    return fixed == bad;
+}
+
+/* Compares what the loader read against the table, fetching whatever differs */
+static bool scratchpad_verify(const char *fname, uint64_t data_offset, const struct scratchpad_file_header *fh,
+                              const uint64_t *want, const uint64_t *got)
+{
+    uint64_t chunks = (fh->scratchpad_size * 8 + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    uint64_t c, bad = 0;
+
+    for (c = 0; c < chunks; c++)
+        bad += want[c] != got[c];
+    if (!bad)
+    {
+        applog(LOG_DEBUG, "verified %" PRIu64 " chunks of %s", chunks, fname);
+        return true;
+    }
+    applog(LOG_NOTICE, "%" PRIu64 " of %" PRIu64 " chunks of %s are damaged", bad, chunks, fname);
+    return scratchpad_repair(fname, data_offset, fh, want, got);
+}
+
+#define SCRATCHPAD_DOWNLOAD_CONNECTIONS 4  /* range requests in flight at once */
+#define SCRATCHPAD_DOWNLOAD_RUN         16 /* chunks asked for by one request */
+#define SCRATCHPAD_DOWNLOAD_RETRIES     8  /* failures in a row before giving up */
+
+#define DL_MISSING  0
+#define DL_FETCHING 1
+#define DL_DONE     2
+
+/*
+ * A download into <cache>.part: the header and extension of the cache file
+ * layout, flagged partial, then a byte per SCRATCHPAD_FILE_CHUNK that is set
+ * once the chunk is on disk, then the data at SCRATCHPAD_FILE_DATA_OFFSET.
+ */
+struct scratchpad_download {
+    const char *url;
+    char fname[PATH_MAX];
+    int fd;
+    uint64_t remote_offset;             /* where the data starts at url */
+    uint64_t bytes, chunks, left;
+    uint8_t *state;                     /* DL_* per chunk */
+    uint64_t *sums;                     /* spio_sum of each chunk as it arrived */
+    uint64_t *want;                     /* the server's checksums, when it has them */
+    uint64_t fetched;                   /* bytes on disk from this run */
+    int fails;
+    bool failed;
+};
+
+struct scratchpad_range {
+    struct scratchpad_download *dl;
+    CURL *curl;
+    bool busy;
+    long long retry_ms;
+    uint64_t chunk, last;               /* chunks [chunk, last) still to come */
+    uint64_t pos, end;                  /* bytes of the data */
+    char range[64];
+    char err[CURL_ERROR_SIZE];
+};
+
+static uint64_t download_chunk_len(const struct scratchpad_download *dl, uint64_t c)
+{
+    uint64_t pos = c * SCRATCHPAD_FILE_CHUNK;
+
+    return pos + SCRATCHPAD_FILE_CHUNK < dl->bytes ? SCRATCHPAD_FILE_CHUNK : dl->bytes - pos;
+}
+
+/* A chunk complete in the buffer: checked, written and marked in the file */
+static bool download_chunk_done(struct scratchpad_download *dl, uint64_t c)
+{
+    uint64_t pos = c * SCRATCHPAD_FILE_CHUNK;
+    size_t len = download_chunk_len(dl, c);
+    const uint8_t *p = (const uint8_t *)pscratchpad_buff + pos;
+    static const uint8_t done = 1;
+
+    dl->sums[c] = spio_sum(p, len);
+    if (dl->want && dl->sums[c] != dl->want[c])
+    {
+        applog(LOG_ERR, "chunk %" PRIu64 " from %s does not match its checksum", c, dl->url);
+        return false;
+    }
+    if (pwrite(dl->fd, p, len, SCRATCHPAD_FILE_DATA_OFFSET + pos) != (ssize_t)len ||
+        pwrite(dl->fd, &done, 1, sizeof(struct scratchpad_file_header) +
+               sizeof(struct scratchpad_file_ext) + c) != 1)
+    {
+        applog(LOG_ERR, "failed to write file %s: %s", dl->fname, strerror(errno));
+        dl->failed = true;
+        return false;
+    }
+    dl->state[c] = DL_DONE;
+    dl->left--;
+    dl->fetched += len;
+    dl->fails = 0;
+    return true;
+}
+
+static size_t download_write(void *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    struct scratchpad_range *r = userdata;
+    struct scratchpad_download *dl = r->dl;
+    size_t n = size * nmemb;
+    long code = 0;
+
+    curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 206 || n > r->end - r->pos)
+    {
+        snprintf(r->err, sizeof(r->err), "HTTP %ld instead of the range asked for", code);
+        return 0;
+    }
+    memcpy((uint8_t *)pscratchpad_buff + r->pos, ptr, n);
+    r->pos += n;
+    while (r->chunk < r->last && r->pos >= r->chunk * SCRATCHPAD_FILE_CHUNK + download_chunk_len(dl, r->chunk))
+    {
+        if (!download_chunk_done(dl, r->chunk))
+            return 0;
+        r->chunk++;
+    }
+    return n;
+}
+
+/* Asks for the next run of missing chunks, false if none is left to ask for */
+static bool download_start(CURLM *multi, struct scratchpad_range *r)
+{
+    struct scratchpad_download *dl = r->dl;
+    uint64_t c;
+
+    for (c = 0; c < dl->chunks && dl->state[c] != DL_MISSING; c++)
+        ;
+    if (c == dl->chunks)
+        return false;
+    r->chunk = r->last = c;
+    while (r->last < dl->chunks && r->last - c < SCRATCHPAD_DOWNLOAD_RUN && dl->state[r->last] == DL_MISSING)
+        dl->state[r->last++] = DL_FETCHING;
+    r->pos = c * SCRATCHPAD_FILE_CHUNK;
+    r->end = (r->last - 1) * SCRATCHPAD_FILE_CHUNK + download_chunk_len(dl, r->last - 1);
+    snprintf(r->range, sizeof(r->range), "%" PRIu64 "-%" PRIu64,
+             dl->remote_offset + r->pos, dl->remote_offset + r->end - 1);
+    r->err[0] = 0;
+    curl_easy_setopt(r->curl, CURLOPT_RANGE, r->range);
+    curl_multi_add_handle(multi, r->curl);
+    r->busy = true;
+    return true;
+}
+
+/* A request ended: whatever it did not bring is missing again */
+static void download_finish(CURLM *multi, struct scratchpad_range *r, CURLcode res)
+{
+    struct scratchpad_download *dl = r->dl;
+    uint64_t c;
+
+    curl_multi_remove_handle(multi, r->curl);
+    r->busy = false;
+    for (c = r->chunk; c < r->last; c++)
+        dl->state[c] = DL_MISSING;
+    if (res == CURLE_OK && r->chunk == r->last)
+        return;
+    if (!r->err[0])
+        snprintf(r->err, sizeof(r->err), "%s", res == CURLE_OK ? "response cut short" : curl_easy_strerror(res));
+    if (++dl->fails >= SCRATCHPAD_DOWNLOAD_RETRIES)
+    {
+        applog(LOG_ERR, "Giving up on range %s of %s: %s", r->range, dl->url, r->err);
+        dl->failed = true;
+        return;
+    }
+    applog(LOG_NOTICE, "Range %s of %s failed: %s, retrying", r->range, dl->url, r->err);
+    r->retry_ms = monotonic_ms() + 1000 * dl->fails;
+}
+
+/*
+ * Opens <cache>.part, picking up where an earlier download of the same
+ * scratchpad stopped: its finished chunks go into the buffer and are
+ * checked, everything else is to be fetched.  Returns the bytes resumed.
+ */
+static uint64_t download_open(struct scratchpad_download *dl, const struct scratchpad_file_header *fh)
+{
+    struct scratchpad_file_header pfh;
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, SCRATCHPAD_FILE_PARTIAL};
+    off_t map_pos = sizeof(pfh) + sizeof(ext);
+    uint64_t c, resumed = 0;
+
+    dl->fd = open(dl->fname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (dl->fd < 0)
+        return 0;
+    if (pread(dl->fd, &pfh, sizeof(pfh), 0) == sizeof(pfh) &&
+        pread(dl->fd, &ext, sizeof(ext), sizeof(pfh)) == sizeof(ext) &&
+        !memcmp(ext.magic, SCRATCHPAD_FILE_MAGIC, sizeof(ext.magic)) && (ext.flags & SCRATCHPAD_FILE_PARTIAL) &&
+        !memcmp(&pfh, fh, sizeof(pfh)) &&
+        pread(dl->fd, dl->state, dl->chunks, map_pos) == (ssize_t)dl->chunks &&
+        scratchpad_fill(dl->fd, dl->fname, SCRATCHPAD_FILE_DATA_OFFSET, dl->bytes / 8, dl->sums))
+    {
+        for (c = 0; c < dl->chunks; c++)
+        {
+            if (dl->state[c] && (!dl->want || dl->sums[c] == dl->want[c]))
+            {
+                dl->state[c] = DL_DONE;
+                dl->left--;
+                resumed += download_chunk_len(dl, c);
+            }
+            else
+                dl->state[c] = DL_MISSING;
+        }
+        return resumed;
+    }
+
+    //something else or nothing, start over
+    memset(dl->state, DL_MISSING, dl->chunks);
+    ext.flags = SCRATCHPAD_FILE_PARTIAL;
+    if (ftruncate(dl->fd, 0) || ftruncate(dl->fd, SCRATCHPAD_FILE_DATA_OFFSET + dl->bytes) ||
+        pwrite(dl->fd, fh, sizeof(*fh), 0) != sizeof(*fh) ||
+        pwrite(dl->fd, &ext, sizeof(ext), sizeof(*fh)) != sizeof(ext) ||
+        pwrite(dl->fd, dl->state, dl->chunks, map_pos) != (ssize_t)dl->chunks)
+    {
+        applog(LOG_ERR, "failed to write file %s: %s", dl->fname, strerror(errno));
+        close(dl->fd);
+        dl->fd = -1;
+    }
+    return 0;
+}
+
+/* The chunk map becomes the checksum table and the part file the cache file */
+static bool download_complete(struct scratchpad_download *dl, const struct scratchpad_file_header *fh,
+                              const char *path_to)
+{
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, 0};
+    struct scratchpad_file_sums sh = {SCRATCHPAD_FILE_CHUNK, dl->chunks};
+    off_t sums_pos = sizeof(*fh) + sizeof(ext);
+
+    if (dl->chunks <= SCRATCHPAD_FILE_MAX_CHUNKS)
+    {
+        ext.flags |= SCRATCHPAD_FILE_CHECKSUMS;
+        if (pwrite(dl->fd, &sh, sizeof(sh), sums_pos) != sizeof(sh) ||
+            pwrite(dl->fd, dl->sums, dl->chunks * 8, sums_pos + sizeof(sh)) != (ssize_t)(dl->chunks * 8))
+            goto fail;
+    }
+    if (pwrite(dl->fd, &ext, sizeof(ext), sizeof(*fh)) != sizeof(ext))
+        goto fail;
+#if defined(POSIX_FADV_DONTNEED)
+    //the buffer has it, the page cache need not
+    posix_fadvise(dl->fd, SCRATCHPAD_FILE_DATA_OFFSET, dl->bytes, POSIX_FADV_DONTNEED);
+#endif
+    if (rename(dl->fname, path_to))
+    {
+        applog(LOG_ERR, "failed to rename %s to %s: %s", dl->fname, path_to, strerror(errno));
+        return false;
+    }
+    return true;
+fail:
+    applog(LOG_ERR, "failed to write file %s: %s", dl->fname, strerror(errno));
+    return false;
+}
+
+/*
+ * The initial download as SCRATCHPAD_DOWNLOAD_CONNECTIONS concurrent range
+ * requests, each written into the mining buffer and <cache>.part as it
+ * arrives.  A failed range is asked for again, a failed run resumes from
+ * the part file on the next call or start.  Returns DOWNLOAD_DONE,
+ * DOWNLOAD_RESUME when the run stopped with chunks kept in the part file,
+ * or DOWNLOAD_WHOLE when the server cannot serve ranges or nothing was
+ * kept; the caller then fetches the file whole.
+ */
+int download_scratchpad(const char *path_to, const char *url)
+{
+    struct scratchpad_download dl = {.url = url, .fd = -1};
+    struct scratchpad_range r[SCRATCHPAD_DOWNLOAD_CONNECTIONS] = {{0}};
+    struct scratchpad_file_header fh;
+    struct scratchpad_file_ext ext;
+    char curl_error_buff[CURL_ERROR_SIZE] = {0};
+    long long start, last_report;
+    uint64_t resumed = 0;
+    CURLM *multi = NULL;
+    CURL *curl;
+    int ret = DOWNLOAD_WHOLE;
+    int i;
+
+    curl = curl_easy_init();
+    if (!curl)
+        return DOWNLOAD_WHOLE;
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buff);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    if (!http_scratchpad_head(curl, url, &fh, &ext))
+    {
+        long code = 0;
+
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        applog(LOG_NOTICE, "No ranged download from %s: %s", url, code == 200 ? "server without ranges" :
+               curl_error_buff[0] ? curl_error_buff : "no scratchpad there");
+        curl_easy_cleanup(curl);
+        //a server that did not answer at all may still serve the rest of a part file
+        snprintf(dl.fname, sizeof(dl.fname), "%s.part", path_to);
+        return !code && !access(dl.fname, F_OK) ? DOWNLOAD_RESUME : DOWNLOAD_WHOLE;
+    }
+    dl.remote_offset = ext.data_offset;
+    dl.bytes = fh.scratchpad_size * 8;
+    dl.chunks = dl.left = (dl.bytes + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    if (dl.bytes > WILD_KECCAK_SCRATCHPAD_BUFFSIZE || fh.scratchpad_size % 4 || !dl.bytes ||
+        dl.chunks > SCRATCHPAD_FILE_DATA_OFFSET - sizeof(fh) - sizeof(ext))
+    {
+        applog(LOG_ERR, "scratchpad at %s has an invalid size (%" PRIu64 ")", url, dl.bytes);
+        curl_easy_cleanup(curl);
+        return DOWNLOAD_WHOLE;
+    }
+    if ((ext.flags & SCRATCHPAD_FILE_CHECKSUMS) && !(ext.flags & SCRATCHPAD_FILE_PARTIAL))
+    {
+        struct scratchpad_file_sums sh;
+
+        dl.want = xmalloc(dl.chunks * 8);
+        if (!http_range(curl, url, sizeof(fh) + sizeof(ext), &sh, sizeof(sh)) ||
+            sh.chunk_size != SCRATCHPAD_FILE_CHUNK || sh.chunks != dl.chunks ||
+            !http_range(curl, url, sizeof(fh) + sizeof(ext) + sizeof(sh), dl.want, dl.chunks * 8))
+        {
+            free(dl.want);
+            dl.want = NULL;
+        }
+    }
+    curl_easy_cleanup(curl);
+    if (!scratchpad_commit(dl.bytes))
+    {
+        free(dl.want);
+        return DOWNLOAD_WHOLE;
+    }
+
+    snprintf(dl.fname, sizeof(dl.fname), "%s.part", path_to);
+    dl.state = xmalloc(dl.chunks);
+    dl.sums = xcalloc(dl.chunks, 8);
+    resumed = download_open(&dl, &fh);
+    if (dl.fd < 0)
+        goto out;
+    applog(LOG_INFO, "Downloading %" PRIu64 " MB of scratchpad at height %" PRIu64 " from %s%s",
+           dl.bytes >> 20, fh.current_hi.height, url, dl.want ? ", checked against its checksums" : "");
+    if (resumed)
+        applog(LOG_INFO, "Resuming with %" PRIu64 " MB already in %s", resumed >> 20, dl.fname);
+
+    multi = curl_multi_init();
+    for (i = 0; i < SCRATCHPAD_DOWNLOAD_CONNECTIONS; i++)
+    {
+        r[i].dl = &dl;
+        r[i].curl = curl_easy_init();
+        if (!multi || !r[i].curl)
+            goto out;
+        curl_easy_setopt(r[i].curl, CURLOPT_URL, url);
+        curl_easy_setopt(r[i].curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(r[i].curl, CURLOPT_ERRORBUFFER, r[i].err);
+        curl_easy_setopt(r[i].curl, CURLOPT_WRITEFUNCTION, download_write);
+        curl_easy_setopt(r[i].curl, CURLOPT_WRITEDATA, &r[i]);
+        curl_easy_setopt(r[i].curl, CURLOPT_PRIVATE, &r[i]);
+        //a stalled connection is dropped and its range asked for again
+        curl_easy_setopt(r[i].curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+        curl_easy_setopt(r[i].curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    }
+
+    start = last_report = monotonic_ms();
+    for (;;)
+    {
+        long long now = monotonic_ms();
+        bool busy = false;
+        CURLMsg *msg;
+        int running, pending;
+
+        for (i = 0; i < SCRATCHPAD_DOWNLOAD_CONNECTIONS; i++)
+        {
+            if (!r[i].busy && !dl.failed && now >= r[i].retry_ms)
+                download_start(multi, &r[i]);
+            busy |= r[i].busy;
+        }
+        if (!busy && (dl.failed || !dl.left))
+            break;
+        if (!busy)
+        {
+            usleep(100000);
+            continue;
+        }
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &pending)))
+        {
+            struct scratchpad_range *rr;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&rr);
+            download_finish(multi, rr, msg->data.result);
+        }
+        curl_multi_wait(multi, NULL, 0, 500, NULL);
+        if (now - last_report >= 5000)
+        {
+            uint64_t have = resumed + dl.fetched;
+
+            applog(LOG_INFO, "Downloaded %" PRIu64 " of %" PRIu64 " MB of scratchpad (%.0f%%), %.1f MB/s",
+                   have >> 20, dl.bytes >> 20, 100.0 * have / dl.bytes,
+                   dl.fetched / 1048576.0 / ((now - start) * 1e-3 + 1e-9));
+            last_report = now;
+        }
+    }
+    if (dl.failed || !download_complete(&dl, &fh, path_to))
+    {
+        if (dl.left == dl.chunks)
+        {
+            applog(LOG_ERR, "Scratchpad download from %s stopped with nothing fetched", url);
+            unlink(dl.fname);
+            goto out;
+        }
+        applog(LOG_ERR, "Scratchpad download from %s stopped with %" PRIu64 " of %" PRIu64 " chunks missing, "
+               "%s keeps the rest for the next try", url, dl.left, dl.chunks, dl.fname);
+        ret = DOWNLOAD_RESUME;
+        goto out;
+    }
+    start = monotonic_ms() - start;
+    applog(LOG_INFO, "Downloaded %" PRIu64 " MB of scratchpad in %lld ms, %.0f MB/s over %d connections, "
+           "%" PRIu64 " MB resumed", dl.fetched >> 20, start, dl.fetched / 1048576.0 / (start * 1e-3 + 1e-9),
+           SCRATCHPAD_DOWNLOAD_CONNECTIONS, resumed >> 20);
+
+    scratchpad_size = fh.scratchpad_size;
+    current_scratchpad_hi = fh.current_hi;
+    memcpy(&add_arr[0], &fh.add_arr[0], sizeof(fh.add_arr));
+    rollback_load();
+    prev_save = time(NULL);
+    journal_reset();
+    ret = DOWNLOAD_DONE;
+out:
+    for (i = 0; i < SCRATCHPAD_DOWNLOAD_CONNECTIONS; i++)
+    {
+        if (r[i].busy)
+            curl_multi_remove_handle(multi, r[i].curl);
+        if (r[i].curl)
+            curl_easy_cleanup(r[i].curl);
+    }
+    if (multi)
+        curl_multi_cleanup(multi);
+    if (dl.fd >= 0)
+        close(dl.fd);
+    free(dl.state);
+    free(dl.sums);
+    free(dl.want);
+    return ret;
+}
+#else
+int download_scratchpad(const char *path_to, const char *url)
+{
+    return DOWNLOAD_WHOLE;
+}
+#endif
+
+bool load_scratchpad_from_file(const char *fname)
+{
+    if(!scratchpad_file_fresh(fname))
+        return false;
+
+    FILE *fp;
+
+    fp = fopen(fname, "rb");
+    if (fp == NULL) 
+    {
+        if (errno != ENOENT) {
+            applog(LOG_ERR, "failed to load %s: %s", fname, strerror(errno));
+        }
+        return false;
+    }
+
+
+    struct scratchpad_file_header fh = {0};
+    uint64_t data_offset;
+    if (!read_scratchpad_file_header(fp, fname, &fh, &data_offset))
+    {
+        fclose(fp);
+        return false;
+    }
+
+#if !defined(_WIN64) && !defined(_WIN32)
+    uint64_t *want = read_scratchpad_sums(fileno(fp), fname, fh.scratchpad_size);
+    uint64_t *got = want ? xcalloc(1, (fh.scratchpad_size * 8 + SCRATCHPAD_FILE_CHUNK - 1) /
+                                      SCRATCHPAD_FILE_CHUNK * 8) : NULL;
+
+    //the loader threads do the first touch
+    scratchpad_region.lazy = true;
+    bool ok = scratchpad_commit(fh.scratchpad_size * 8);
+    scratchpad_region.lazy = false;
+    ok = ok && scratchpad_fill(fileno(fp), fname, data_offset, fh.scratchpad_size, got);
+    if (ok && want)
+        ok = scratchpad_verify(fname, data_offset, &fh, want, got);
+    free(want);
+    free(got);
+    if (!ok)
+    {
+        fclose(fp);
+        return false;
+    }
+#else
+    if (!scratchpad_commit(fh.scratchpad_size * 8))
+    {
+        fclose(fp);
+        return false;
+    }
+    if (fread(pscratchpad_buff, 8,  fh.scratchpad_size, fp) != fh.scratchpad_size)
+    {
+        applog(LOG_ERR, "read error from %s: %s", fname, strerror(errno));
+        fclose(fp);
         return false;
     }
-    applog(LOG_DEBUG, "saved scratchpad to %s (%zu+%zu bytes)", pscratchpad_local_cache,
-        sizeof(struct scratchpad_file_header), (size_t)scratchpad_size * 8);
+#endif
+    scratchpad_size = fh.scratchpad_size;
+    current_scratchpad_hi = fh.current_hi;
+    memcpy(&add_arr[0], &fh.add_arr[0], sizeof(fh.add_arr));
+    rollback_load();
+
+    applog(LOG_DEBUG, "loaded scratchpad %s (%zu bytes), height=%" PRIu64, fname, 
+           scratchpad_size*8, current_scratchpad_hi.height);
+    fclose(fp);
+    prev_save = time(NULL);
+
+    bool torn = false;
+    if (!journal_replay(&torn))
+        journal_reset();
+    else if (torn)
+        store_scratchpad_to_file(false); //drops the damaged tail along with the rest
+    else
+    {
+        char jname[PATH_MAX];
+        journal_name(jname, sizeof(jname));
+        journal_fp = fopen(jname, "ab");
+    }
     return true;
 }
 
-/* TODO: repetitive error+log spam handling */
-bool load_scratchpad_from_file(const char *fname)
+#if defined(__linux__)
+/*
+ * The scratchpad the process before a hot restart left in a memfd, mapped
+ * as it is where it backed its buffer with huge pages and copied in
+ * otherwise, and its state from a second one.
+ */
+static bool load_scratchpad_from_handoff(int fd, int state_fd, int type)
 {
+    struct scratchpad_file_header fh = {0};
+    char jname[PATH_MAX];
+    bool ok;
 
-    struct stat file_stat;
-    if(stat(fname, &file_stat) < 0)    
+    ok = pread(state_fd, &fh, sizeof(fh), 0) == sizeof(fh) &&
+         fh.scratchpad_size * 8 <= scratchpad_region.reserved;
+    close(state_fd);
+    if (!ok)
     {
-        applog(LOG_ERR, "fstat error from %s: %s", fname, strerror(errno));
+        applog(LOG_ERR, "Hot restart: no scratchpad state handed over");
+        close(fd);
         return false;
     }
-    if(time(NULL) - file_stat.st_mtime > LOCAL_SCRATCHPAD_CACHE_EXPIRATION_INTERVAL)
+    scratchpad_region.lazy = true; //a copy touches it first
+    ok = pages_adopt(&scratchpad_region, fd, type);
+    scratchpad_region.lazy = false;
+    if (!ok)
     {
-        applog(LOG_NOTICE, "Scratchpad file is too old %s", fname);
+        applog(LOG_ERR, "Hot restart: failed to take over the handed-over scratchpad: %s", strerror(errno));
         return false;
     }
+    if (scratchpad_region.committed < fh.scratchpad_size * 8)
+    {
+        //the region keeps what it took, loading from the cache file grows it as usual
+        applog(LOG_ERR, "Hot restart: the handed-over scratchpad is short of its %" PRIu64 " words",
+               fh.scratchpad_size);
+        return false;
+    }
+    scratchpad_size = fh.scratchpad_size;
+    current_scratchpad_hi = fh.current_hi;
+    memcpy(&add_arr[0], &fh.add_arr[0], sizeof(fh.add_arr));
+    rollback_load();
+    applog(LOG_INFO, "Hot restart: took over %zu MB of scratchpad at height %" PRIu64 " in %lld ms",
+           (size_t)(scratchpad_size * 8) >> 20, current_scratchpad_hi.height, monotonic_ms() - hot_restart_ms);
 
+    //the journal on disk still takes the cache file up to this state, keep appending to it
+    prev_save = time(NULL);
+    journal_name(jname, sizeof(jname));
+    journal_fp = fopen(jname, "ab");
+    if (journal_fp && !fseek(journal_fp, 0, SEEK_END))
+        journal_bytes = ftell(journal_fp);
+    return true;
+}
 
-    FILE *fp;
+/*
+ * Stops the miners and has the workio thread submit the shares they
+ * queued, waiting for it a few seconds at most, so that the exec does not
+ * drop them.  The stratum connection has to stay up until then.
+ */
+static void drain_results(void)
+{
+    struct workio_cmd *wc;
+    struct thread_q *done;
+    struct timespec abstime;
 
-    fp = fopen(fname, "rb");
-    if (fp == NULL) 
+    stratum_have_work = false;
+    restart_threads();
+    done = tq_new();
+    wc = xcalloc(1, sizeof(*wc));
+    wc->cmd = WC_FLUSH_RESULTS;
+    wc->u.done = done;
+    if (!tq_push(thr_info[work_thr_id].q, wc))
     {
-        if (errno != ENOENT) {
-            applog(LOG_ERR, "failed to load %s: %s", fname, strerror(errno));
+        workio_cmd_free(wc);
+        tq_free(done);
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += HOT_RESTART_DRAIN_TIMEOUT;
+    if (tq_pop(done, &abstime))
+        tq_free(done);
+    else //left to the workio thread, which still answers on it
+        applog(LOG_ERR, "Hot restart: queued shares not submitted after %d s", HOT_RESTART_DRAIN_TIMEOUT);
+}
+
+/*
+ * SIGUSR2: runs the miner binary again in this process.  The new image
+ * inherits the scratchpad in a memfd, so it neither reads the cache file
+ * nor downloads: the memfd hugetlb pages back the buffer with is mapped
+ * as it is, anonymous pages are copied into a fresh one.  The state goes
+ * over in a second memfd.  A mapped cache file or shared segment outlives
+ * the exec by itself.  Only returns if the exec fails.
+ */
+static void hot_restart(void)
+{
+    struct scratchpad_file_header sf = {0};
+    struct rlimit rl;
+    char env[96];
+    int fd = -1, state_fd = -1, type = scratchpad_region.type, i;
+
+    hot_restart_requested = 0;
+    applog(LOG_NOTICE, "Hot restart: handing the scratchpad over to %s", restart_path);
+    if (!opt_scratchpad_mmap && !opt_scratchpad_shm && scratchpad_size)
+    {
+        memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
+        sf.current_hi = current_scratchpad_hi;
+        sf.scratchpad_size = scratchpad_size;
+        fd = pages_handoff(&scratchpad_region, scratchpad_size * 8, &type);
+        state_fd = fd < 0 ? -1 : memfd_create("minerd-state", 0);
+        if (state_fd < 0 || write(state_fd, &sf, sizeof(sf)) != sizeof(sf))
+        {
+            applog(LOG_ERR, "Hot restart: no memfd for the scratchpad: %s", strerror(errno));
+            if (state_fd >= 0)
+                close(state_fd);
+            if (fd >= 0 && fd != scratchpad_region.fd)
+                close(fd);
+            return;
         }
+    }
+    else
+        scratchpad_end_update(); //header of a mapped file, state of a shared segment
+
+    if (!opt_benchmark)
+        drain_results();
+    snprintf(env, sizeof(env), "%d:%d:%d:%lld", fd, state_fd, type, monotonic_ms());
+    setenv(HOT_RESTART_ENV, env, 1);
+    stratum_disconnect(&stratum);
+    //nothing but the memfds goes to the new image
+#ifdef CLOSE_RANGE_CLOEXEC
+    if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC))
+#endif
+    {
+        if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY)
+            rl.rlim_cur = 65536;
+        for (i = 3; i < (int)rl.rlim_cur; i++)
+            fcntl(i, F_SETFD, FD_CLOEXEC);
+    }
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, 0);
+    if (state_fd >= 0)
+        fcntl(state_fd, F_SETFD, 0);
+    execvp(restart_path, restart_argv);
+
+    applog(LOG_ERR, "Hot restart: failed to run %s: %s", restart_path, strerror(errno));
+    unsetenv(HOT_RESTART_ENV);
+    if (state_fd >= 0)
+        close(state_fd);
+    if (fd >= 0 && fd != scratchpad_region.fd)
+        close(fd);
+}
+#endif
+
+#if !defined(_WIN64) && !defined(_WIN32)
+/* Rewrites a downloaded file in our layout so that its data can be mapped */
+static bool convert_scratchpad_file(const char *fname, FILE *in, const struct scratchpad_file_header *fh)
+{
+    char file_name_buff[PATH_MAX];
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, 0};
+    uint64_t left = fh->scratchpad_size * 8;
+    char *buf = xmalloc(1 << 20);
+    FILE *out;
+
+    snprintf(file_name_buff, sizeof(file_name_buff), "%s.tmp", fname);
+    unlink(file_name_buff);
+    out = fopen(file_name_buff, "wbx");
+    if (!out)
+    {
+        applog(LOG_ERR, "failed to create file %s: %s", file_name_buff, strerror(errno));
+        free(buf);
+        return false;
+    }
+    if (fwrite(fh, sizeof(*fh), 1, out) != 1 || fwrite(&ext, sizeof(ext), 1, out) != 1 ||
+        fseek(out, SCRATCHPAD_FILE_DATA_OFFSET, SEEK_SET))
+        goto err_out;
+    while (left)
+    {
+        size_t n = left < (1 << 20) ? left : (1 << 20);
+        if (fread(buf, 1, n, in) != n || fwrite(buf, 1, n, out) != n)
+            goto err_out;
+        left -= n;
+    }
+    if (fclose(out) == EOF)
+    {
+        out = NULL;
+        goto err_out;
+    }
+    free(buf);
+    if (rename(file_name_buff, fname) == -1)
+    {
+        applog(LOG_ERR, "failed to rename %s to %s: %s", file_name_buff, fname, strerror(errno));
+        unlink(file_name_buff);
         return false;
     }
+    applog(LOG_DEBUG, "converted scratchpad %s to the mappable layout", fname);
+    return true;
 
+err_out:
+    applog(LOG_ERR, "failed to convert scratchpad %s: %s", fname, strerror(errno));
+    if (out)
+        fclose(out);
+    unlink(file_name_buff);
+    free(buf);
+    return false;
+}
 
+/*
+ * Maps the cache file straight in as the mining buffer.  The mapping
+ * spans the whole reserved size and scratchpad_commit extends the file
+ * under it as addenda are appended through it; afterwards only the
+ * header needs rewriting.
+ */
+bool map_scratchpad_file(const char *fname)
+{
     struct scratchpad_file_header fh = {0};
-    if ((fread(&fh, sizeof(fh), 1, fp) != 1))
+    uint64_t data_offset;
+    FILE *fp;
+    void *p;
+    int fd;
+
+    if(!scratchpad_file_fresh(fname))
+        return false;
+
+    fp = fopen(fname, "r+b");
+    if (fp == NULL)
+    {
+        if (errno != ENOENT)
+            applog(LOG_ERR, "failed to open %s: %s", fname, strerror(errno));
+        return false;
+    }
+    if (!read_scratchpad_file_header(fp, fname, &fh, &data_offset))
     {
-        applog(LOG_ERR, "read error from %s: %s", fname, strerror(errno));
         fclose(fp);
         return false;
     }
-
-
-    if ((fh.scratchpad_size*8 > (WILD_KECCAK_SCRATCHPAD_BUFFSIZE)) ||(fh.scratchpad_size%4)) 
+    if (data_offset != SCRATCHPAD_FILE_DATA_OFFSET)
     {
-        applog(LOG_ERR, "file %s size invalid (%" PRIu64 "), max=%zu",
-            fname, fh.scratchpad_size*8, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
+        bool ok = convert_scratchpad_file(fname, fp, &fh);
+        fclose(fp);
+        return ok && map_scratchpad_file(fname);
+    }
+    if (data_offset % sysconf(_SC_PAGESIZE))
+    {
+        applog(LOG_ERR, "scratchpad data in %s is not page aligned", fname);
         fclose(fp);
         return false;
     }
 
-    if (fread(pscratchpad_buff, 8,  fh.scratchpad_size, fp) != fh.scratchpad_size)
+    fd = dup(fileno(fp));
+    fclose(fp);
+    if (fd < 0)
     {
-        applog(LOG_ERR, "read error from %s: %s", fname, strerror(errno));
-        fclose(fp);
+        applog(LOG_ERR, "failed to open %s: %s", fname, strerror(errno));
+        return false;
+    }
+    p = mmap(0, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, data_offset);
+    if (p == MAP_FAILED)
+    {
+        applog(LOG_ERR, "failed to map %s: %s", fname, strerror(errno));
+        close(fd);
+        return false;
+    }
+    /* huge pages where the filesystem can back them (tmpfs huge=advise) */
+    madvise(p, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, MADV_HUGEPAGE);
+    madvise(p, fh.scratchpad_size * 8, MADV_WILLNEED);
+
+    pscratchpad_buff = p;
+    scratchpad_fd = fd;
+    scratchpad_file_bytes = 0;
+    if (!scratchpad_commit(fh.scratchpad_size * 8))
+    {
+        munmap(p, WILD_KECCAK_SCRATCHPAD_BUFFSIZE);
+        close(fd);
+        pscratchpad_buff = NULL;
+        scratchpad_fd = -1;
         return false;
     }
     scratchpad_size = fh.scratchpad_size;
     current_scratchpad_hi = fh.current_hi;
     memcpy(&add_arr[0], &fh.add_arr[0], sizeof(fh.add_arr));
+    rollback_load();
 
-    applog(LOG_DEBUG, "loaded scratchpad %s (%zu bytes), height=%" PRIu64, fname, 
+    applog(LOG_INFO, "mapped scratchpad %s (%zu bytes), height=%" PRIu64, fname,
            scratchpad_size*8, current_scratchpad_hi.height);
-    fclose(fp);
     prev_save = time(NULL);
     return true;
 }
 
+static bool write_mapped_scratchpad_ext(uint64_t flags)
+{
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, flags};
+
+    if (pwrite(scratchpad_fd, &ext, sizeof(ext), sizeof(struct scratchpad_file_header)) != sizeof(ext))
+    {
+        applog(LOG_ERR, "failed to write %s: %s", pscratchpad_local_cache, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Writes the header for what the mapping now holds and clears the dirty flag */
+static bool commit_mapped_scratchpad(void)
+{
+    struct scratchpad_file_header sf = {0};
+
+    memcpy(&sf.add_arr[0], &add_arr[0], sizeof(sf.add_arr));
+    sf.current_hi = current_scratchpad_hi;
+    sf.scratchpad_size = scratchpad_size;
+    if (pwrite(scratchpad_fd, &sf, sizeof(sf), 0) != sizeof(sf))
+    {
+        applog(LOG_ERR, "failed to write %s: %s", pscratchpad_local_cache, strerror(errno));
+        return false;
+    }
+    return write_mapped_scratchpad_ext(0);
+}
+#endif
+
+/* The state of the scratchpad as a file header; false when another
+ * process changes the data, a reader of a shared segment */
+bool scratchpad_state(struct scratchpad_file_header *fh)
+{
+    memset(fh, 0, sizeof(*fh));
+    if (opt_scratchpad_shm && !shm_writer)
+        return false;
+    memcpy(&fh->add_arr[0], &add_arr[0], sizeof(fh->add_arr));
+    fh->current_hi = current_scratchpad_hi;
+    fh->scratchpad_size = scratchpad_size;
+    return true;
+}
+
+/* Brackets changes to scratchpad data; a mapped file is flagged dirty in
+ * between so a crash leaves a file the next start refuses to map, and
+ * readers of a shared segment stop taking its state */
+void scratchpad_begin_update(void)
+{
+    if (!(scratchpad_seq & 1))
+        __atomic_store_n(&scratchpad_seq, scratchpad_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    shm_begin();
+#if !defined(_WIN64) && !defined(_WIN32)
+    if (scratchpad_fd >= 0)
+        write_mapped_scratchpad_ext(SCRATCHPAD_FILE_DIRTY);
+#endif
+}
+
+void scratchpad_end_update(void)
+{
+    if (shm_writer)
+        shm_publish_state();
+#if !defined(_WIN64) && !defined(_WIN32)
+    if (scratchpad_fd >= 0)
+        commit_mapped_scratchpad();
+#endif
+    scratchpad_seq_end();
+}
 
 bool dump_scratchpad_to_file_debug()
 {
@@ -1845,6 +3682,16 @@ static void *stratum_thread(void *userdata) {
     if (!stratum.url)
         goto out;
     applog(LOG_INFO, "Starting Stratum on %s", stratum.url);
+#if defined(__linux__)
+    {
+        sigset_t sigs;
+
+        //SIGUSR2 is blocked everywhere else, so it breaks the select below
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGUSR2);
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+    }
+#endif
 
     while (1) {
         int failures = 0;
@@ -2078,14 +3925,15 @@ else
         if(need_to_rerequest_job)
         {
             applog(LOG_ERR, "Re-requesting job...");
+            need_to_rerequest_job = false; //set again if the answer does not fit either
             if(!stratum_request_job(&stratum))
             {
+              need_to_rerequest_job = true;
               stratum_disconnect(&stratum);
               applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
               sleep(opt_fail_pause);
               continue;
             }
-            need_to_rerequest_job = false;
         }
 
         if(!scratchpad_size)
@@ -2106,8 +3954,8 @@ else
                 sleep(opt_fail_pause);
             }
         }
-        /* save every 12 hours */
-        if ((time(NULL) - prev_save) > 12*3600)
+        /* save every 12 hours, or sooner once the journal has grown large */
+        if ((time(NULL) - prev_save) > 12*3600 || journal_bytes > SCRATCHPAD_JOURNAL_COMPACT_SIZE)
         {
             store_scratchpad_to_file(false);
             prev_save = time(NULL);
@@ -2138,7 +3986,15 @@ else
             }
         }
 
+#if defined(__linux__)
+        if (hot_restart_requested)
+            hot_restart();
+#endif
         if (!stratum_socket_full(&stratum, 400)) {
+#if defined(__linux__)
+            if (hot_restart_requested)
+                continue;
+#endif
             applog(LOG_ERR, "Stratum connection timed out");
             s = NULL;
         } else
@@ -2173,6 +4029,9 @@ static void show_version_and_exit(void) {
 #if defined(__x86_64__) && defined(USE_AVX2)
         " AVX2"
 #endif
+#if defined(__x86_64__) && defined(USE_AVX512)
+        " AVX512"
+#endif
 #if defined(__x86_64__) && defined(USE_XOP)
         " XOP"
 #endif
@@ -2364,6 +4223,71 @@ static void parse_arg(int key, char *arg) {
         want_stratum = false;
         have_stratum = false;
         break;
+    case 1011:
+        v = atoi(arg);
+        if (!wild_keccak_lanes_valid(v)) /* sanity check */
+            show_usage_and_exit(1);
+        opt_lanes = v;
+        break;
+    case 1012:
+        free(opt_kernel);
+        opt_kernel = xstrdup(arg);
+        break;
+    case 1013:
+        v = atoi(arg);
+        if (v < 0 || v >= WILD_KECCAK_MAX_LANES) /* sanity check */
+            show_usage_and_exit(1);
+        opt_prefetch_distance = v;
+        break;
+    case 1014:
+        v = atoi(arg);
+        if (v < 0 || v > 3) /* sanity check */
+            show_usage_and_exit(1);
+        opt_prefetch_hint = v;
+        break;
+    case 1015:
+        opt_bench_suite = true;
+        break;
+    case 1016:
+        v = atoi(arg);
+        if (v < 1 || v > (WILD_KECCAK_SCRATCHPAD_BUFFSIZE >> 20)) /* sanity check */
+            show_usage_and_exit(1);
+        opt_bench_size = v;
+        break;
+    case 1017:
+        v = atoi(arg);
+        if (v < 1 || v > 3600) /* sanity check */
+            show_usage_and_exit(1);
+        opt_bench_time = v;
+        break;
+    case 1018:
+        free(opt_bench_json);
+        opt_bench_json = xstrdup(arg);
+        break;
+    case 1019:
+        opt_numa = true;
+        break;
+    case 1020:
+        if (!pages_parse(arg, &opt_pages))
+            show_usage_and_exit(1);
+        break;
+    case 1021:
+        opt_scratchpad_mmap = true;
+        break;
+    case 1022:
+        opt_bench_hex = true;
+        break;
+    case 1023:
+        opt_bench_index = true;
+        break;
+    case 1024:
+        free(opt_scratchpad_shm);
+        opt_scratchpad_shm = xstrdup(arg);
+        break;
+    case 1025:
+        free(opt_scratchpad_serve);
+        opt_scratchpad_serve = xstrdup(arg);
+        break;
     case 1003:
         want_longpoll = false;
         break;
@@ -2450,6 +4374,11 @@ static void signal_handler(int sig) {
         applog(LOG_INFO, "SIGTERM received, exiting");
         exit(0);
         break;
+#if defined(__linux__)
+    case SIGUSR2:
+        hot_restart_requested = 1;
+        break;
+#endif
     }
 }
 #endif
@@ -2508,6 +4437,7 @@ int main(int argc, char *argv[]) {
     rpc_pass = xstrdup("");
 
     tzset();
+    start_ms = monotonic_ms();
 
     pthread_mutex_init(&applog_lock, NULL );
     pthread_mutex_init(&stats_lock, NULL );
@@ -2516,9 +4446,67 @@ int main(int argc, char *argv[]) {
     pthread_mutex_init(&stratum.sock_lock, NULL );
     pthread_mutex_init(&stratum.work_lock, NULL );
 
+#if defined(__linux__)
+    /* what a hot restart runs, resolved before the chdir to the cache dir */
+    restart_argv = argv;
+    if (!strchr(argv[0], '/') || !realpath(argv[0], restart_path))
+        snprintf(restart_path, sizeof(restart_path), "%s", argv[0]);
+    if (getenv(HOT_RESTART_ENV))
+    {
+        if (sscanf(getenv(HOT_RESTART_ENV), "%d:%d:%d:%lld", &hot_restart_fd, &hot_restart_state_fd,
+                   &hot_restart_pages, &hot_restart_ms) != 4)
+            hot_restart_fd = hot_restart_state_fd = -1;
+        unsetenv(HOT_RESTART_ENV);
+    }
+    {
+        sigset_t sigs;
+
+        /* SIGUSR2 asks for a hot restart, which the stratum thread does.
+         * Blocked before anything that loads for long or starts a thread,
+         * it waits pending until that thread unblocks it. */
+        signal(SIGUSR2, signal_handler);
+        sigemptyset(&sigs);
+        sigaddset(&sigs, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    }
+#endif
+
     /* parse command line */
     parse_cmdline(argc, argv);
 
+#if defined(WIN32)
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    num_processors = sysinfo.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_CONF)
+    num_processors = sysconf(_SC_NPROCESSORS_CONF);
+#elif defined(CTL_HW) && defined(HW_NCPU)
+    int req[] = {CTL_HW, HW_NCPU};
+    size_t len = sizeof(num_processors);
+    sysctl(req, 2, &num_processors, &len, NULL, 0);
+#else
+    num_processors = 1;
+#endif
+    if (num_processors < 1)
+        num_processors = 1;
+
+    if (opt_bench_suite || opt_bench_hex || opt_bench_index) {
+        struct bench_params bp = {
+            .threads = opt_n_threads,
+            .max_threads = opt_n_threads ? opt_n_threads : num_processors,
+            .kernel = opt_kernel,
+            .lanes = opt_lanes,
+            .size_mb = opt_bench_size,
+            .seconds = opt_bench_time,
+            .json_file = opt_bench_json,
+        };
+        if (opt_bench_hex)
+            return run_hex_bench(&bp) ? 0 : 1;
+        if (opt_bench_index)
+            return run_index_bench(&bp) ? 0 : 1;
+        return run_bench_suite(&bp) ? 0 : 1;
+    }
+
 	jsonrpc_2 = true;
 	if(!pscratchpad_local_cache)
 	{
@@ -2558,39 +4546,118 @@ int main(int argc, char *argv[]) {
 	applog(LOG_DEBUG, "wildkeccak scratchpad cache %s", pscratchpad_local_cache);
 
 	applog(LOG_INFO, "Using JSON-RPC 2.0");
-	size_t sz = WILD_KECCAK_SCRATCHPAD_BUFFSIZE;
+	if (!wild_keccak_set_kernel(opt_kernel))
+		return 1;
+	applog(LOG_INFO, "Using WildKeccak kernel %s, %d lanes per thread, prefetch distance %d, hint %d",
+	       wild_keccak_kernel_name(), opt_lanes, opt_prefetch_distance, opt_prefetch_hint);
+	if (!opt_n_threads)
+		opt_n_threads = num_processors; //the loader runs one thread per miner thread
+	bool (*load_scratchpad)(const char *fname) = load_scratchpad_from_file;
 #if !defined(_WIN64) && !defined(_WIN32)
-	pscratchpad_buff = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
-		MAP_HUGETLB | MAP_POPULATE, 0, 0);
-	if(MAP_FAILED == pscratchpad_buff)      
+	if(opt_scratchpad_mmap)
+		load_scratchpad = map_scratchpad_file; //the mapping is the buffer
+#else
+	if(opt_scratchpad_mmap)
+		applog(LOG_INFO, "--scratchpad-mmap is not supported on Windows, reading the file instead");
+	opt_scratchpad_mmap = false;
+#endif
+	if(opt_scratchpad_shm)
+	{
+		struct scratchpad_file_header fh;
+
+		if(opt_scratchpad_mmap || opt_numa)
+		{
+			applog(LOG_ERR, "--scratchpad-shm cannot be combined with --scratchpad-mmap or --numa");
+			return 1;
+		}
+		pscratchpad_buff = shm_attach(opt_scratchpad_shm);
+		if(!pscratchpad_buff)
+			return 1;
+		//a reader waits for the writer to load it, or takes over
+		while(!shm_read(&fh) && !shm_try_promote())
+			sleep(1);
+		if(shm_read(&fh))
+		{
+			shm_adopt(&fh);
+			if(shm_writer)
+				store_scratchpad_to_file(false);
+		}
+		else
+			shm_begin(); //loaded below, published once complete
+	}
+	else if(!opt_scratchpad_mmap)
 	{
-		applog(LOG_INFO, "hugetlb not available");
+		size_t sz = WILD_KECCAK_SCRATCHPAD_BUFFSIZE;
+		if(!pages_reserve(&scratchpad_region, sz, opt_pages))
+		{
+			applog(LOG_ERR, "Failed to reserve %zu MB of address space for the scratchpad", sz >> 20);
+			return 1;
+		}
+#if defined(__linux__)
+		//in a memfd that a hot restart hands over as it is
+		scratchpad_region.shared = true;
 #endif
-		pscratchpad_buff = xmalloc(sz);
-#if !defined(_WIN64) && !defined(_WIN32)
-	} else {
-		applog(LOG_INFO, "using hugetlb");
+		pscratchpad_buff = (uint64_t*)scratchpad_region.base;
+	}
+#if defined(__linux__)
+	if(hot_restart_fd >= 0 && hot_restart_state_fd >= 0 && !opt_scratchpad_mmap && !opt_scratchpad_shm)
+		load_scratchpad_from_handoff(hot_restart_fd, hot_restart_state_fd, hot_restart_pages);
+	else
+	{
+		if(hot_restart_fd >= 0)
+			close(hot_restart_fd);
+		if(hot_restart_state_fd >= 0)
+			close(hot_restart_state_fd);
 	}
-#endif        //try to load scratchpad from file 
-	if(!load_scratchpad_from_file(pscratchpad_local_cache))
+#endif
+	//try to load scratchpad from file 
+	if(!scratchpad_size && !load_scratchpad(pscratchpad_local_cache))
 	{
 		if(!pscratchpad_url)
 		{
 			applog(LOG_ERR, "Scratchpad URL not set. Please specify correct scratchpad url by -k or --scratchpad option");
 			return 1;
 		}
-		if(!download_inital_scratchpad(pscratchpad_local_cache, pscratchpad_url))
+		//ranges straight into the buffer where the server has them, else the whole file and a load
+		int ranged = opt_scratchpad_mmap ? DOWNLOAD_WHOLE :
+		             download_scratchpad(pscratchpad_local_cache, pscratchpad_url);
+		for(int failures = 0; ranged == DOWNLOAD_RESUME; )
 		{
-			applog(LOG_ERR, "Scratchpad not found and not downloaded. Please specify correct scratchpad url by -k or --scratchpad  option");
-			return 1;
+			//what the part file holds is not thrown away for a single stream
+			if(opt_retries >= 0 && ++failures > opt_retries)
+			{
+				applog(LOG_ERR, "Scratchpad download failed, the next start resumes it");
+				return 1;
+			}
+			applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
+			sleep(opt_fail_pause);
+			ranged = download_scratchpad(pscratchpad_local_cache, pscratchpad_url);
 		}
-		if(!load_scratchpad_from_file(pscratchpad_local_cache))
+		if(ranged == DOWNLOAD_WHOLE)
 		{
-			applog(LOG_ERR, "Failed to load scratchpad data after downloading, probably broken scratchpad link, please restart miner with correct inital scratcpad link(-k or --scratchpad )");
-			unlink(pscratchpad_local_cache);
-			return 1;
+			char part[PATH_MAX + 5];
+
+			if(!download_inital_scratchpad(pscratchpad_local_cache, pscratchpad_url))
+			{
+				applog(LOG_ERR, "Scratchpad not found and not downloaded. Please specify correct scratchpad url by -k or --scratchpad  option");
+				return 1;
+			}
+			if(!load_scratchpad(pscratchpad_local_cache))
+			{
+				applog(LOG_ERR, "Failed to load scratchpad data after downloading, probably broken scratchpad link, please restart miner with correct inital scratcpad link(-k or --scratchpad )");
+				unlink(pscratchpad_local_cache);
+				return 1;
+			}
+			//a ranged download of an older scratchpad is of no use any more
+			snprintf(part, sizeof(part), "%s.part", pscratchpad_local_cache);
+			unlink(part);
 		}
 	}
+	if(shm_writer)
+		shm_publish_state();
+	else if(!opt_scratchpad_mmap && !opt_scratchpad_shm)
+		pages_region_report("Scratchpad buffer", &scratchpad_region);
+	scratchpad_ready_ms = monotonic_ms();
 
     if (!opt_benchmark && !rpc_url) {
         fprintf(stderr, "%s: no URL supplied\n", argv[0]);
@@ -2627,23 +4694,12 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-#if defined(WIN32)
-    SYSTEM_INFO sysinfo;
-    GetSystemInfo(&sysinfo);
-    num_processors = sysinfo.dwNumberOfProcessors;
-#elif defined(_SC_NPROCESSORS_CONF)
-    num_processors = sysconf(_SC_NPROCESSORS_CONF);
-#elif defined(CTL_HW) && defined(HW_NCPU)
-    int req[] = {CTL_HW, HW_NCPU};
-    size_t len = sizeof(num_processors);
-    sysctl(req, 2, &num_processors, &len, NULL, 0);
-#else
-    num_processors = 1;
-#endif
-    if (num_processors < 1)
-        num_processors = 1;
-    if (!opt_n_threads)
-        opt_n_threads = num_processors;
+    /* after the fork, which its thread would not survive */
+    if (opt_scratchpad_serve && !seed_start(opt_scratchpad_serve))
+        return 1;
+
+    if (opt_numa && !numa_init(opt_n_threads))
+        return 1;
 
 #ifdef HAVE_SYSLOG_H
     if (use_syslog)
@@ -2651,6 +4707,7 @@ int main(int argc, char *argv[]) {
 #endif
 
     work_restart = xcalloc(opt_n_threads, sizeof(*work_restart));
+    result_rings = xcalloc(opt_n_threads, sizeof(*result_rings));
     thr_info = xcalloc(opt_n_threads + 3, sizeof(*thr));
     thr_hashrates = xcalloc(opt_n_threads, sizeof(double));
 
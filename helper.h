@@ -249,6 +249,17 @@ static inline void prefetch3(const void *ptr)
   __builtin_prefetch(ptr, 0, 3);
 }
 
+/* Locality picked at runtime; the switch is perfectly predicted in loops */
+static inline void prefetch_hint(const void *ptr, int hint)
+{
+  switch (hint) {
+  case 0: prefetch0(ptr); break;
+  case 2: prefetch2(ptr); break;
+  case 3: prefetch3(ptr); break;
+  default: prefetch1(ptr); break;
+  }
+}
+
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
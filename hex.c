@@ -0,0 +1,255 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Hex codec behind hex2bin and bin2hex.  Job blobs and shares are short,
+// but addenda and the full scratchpad download run to hundreds of MB, so
+// both directions have SSE2 and AVX2 paths that work out every character
+// with compares and adds instead of the table the plain C code uses.  As
+// with the WildKeccak kernels, the AVX2 code is built with a target
+// attribute and only used when the CPU reports it.
+
+#include "cpuminer-config.h"
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "miner.h"
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* value + 1 of every hex digit; 0 marks anything else */
+static const signed char hex_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+static bool hex_decode_scalar(unsigned char *p, const char *hexstr, size_t len)
+{
+    size_t i;
+    int hi, lo, bad = 0;
+
+    /* no early exit, checking once at the end keeps the loop branch free */
+    for (i = 0; i < len; i++) {
+        hi = hex_table[(unsigned char)hexstr[2 * i]] - 1;
+        lo = hex_table[(unsigned char)hexstr[2 * i + 1]] - 1;
+        bad |= hi | lo;
+        p[i] = (unsigned)hi << 4 | (unsigned)lo;
+    }
+    return bad >= 0;
+}
+
+static void hex_encode_scalar(char *s, const unsigned char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        s[2 * i] = hex_digits[p[i] >> 4];
+        s[2 * i + 1] = hex_digits[p[i] & 0xf];
+    }
+}
+
+#if defined(__SSE2__)
+
+/*
+ * Characters to nibble values, 16 at a time.  A character is a digit if
+ * c - '0' is at most 9 and a letter if (c | 0x20) - 'a' is at most 5, both
+ * as unsigned bytes, which min_epu8 tests without signed compare tricks.
+ */
+static inline __m128i hex_values_sse2(__m128i c, __m128i *bad)
+{
+    const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    const __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    const __m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+    const __m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+
+    *bad = _mm_or_si128(*bad, _mm_andnot_si128(_mm_or_si128(is_d, is_l), _mm_set1_epi8(-1)));
+    return _mm_or_si128(_mm_and_si128(is_d, d),
+                        _mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+/* Pairs of nibbles to bytes: each 16-bit word holds the high nibble first */
+static inline __m128i hex_pack_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00ff)), 4),
+                        _mm_srli_epi16(v, 8));
+}
+
+/* Nibble values to characters: '0' + n, plus the gap to 'a' above 9 */
+static inline __m128i hex_chars_sse2(__m128i n)
+{
+    const __m128i gt9 = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                        _mm_and_si128(gt9, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+static bool hex_decode_sse2(unsigned char *p, const char *hexstr, size_t len)
+{
+    __m128i bad = _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i v0 = hex_values_sse2(_mm_loadu_si128((const __m128i *)(hexstr + 2 * i)), &bad);
+        __m128i v1 = hex_values_sse2(_mm_loadu_si128((const __m128i *)(hexstr + 2 * i + 16)), &bad);
+
+        _mm_storeu_si128((__m128i *)(p + i), _mm_packus_epi16(hex_pack_sse2(v0), hex_pack_sse2(v1)));
+    }
+    if (_mm_movemask_epi8(bad))
+        return false;
+    return hex_decode_scalar(p + i, hexstr + 2 * i, len - i);
+}
+
+static void hex_encode_sse2(char *s, const unsigned char *p, size_t len)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hi = hex_chars_sse2(_mm_and_si128(_mm_srli_epi16(b, 4), mask));
+        __m128i lo = hex_chars_sse2(_mm_and_si128(b, mask));
+
+        _mm_storeu_si128((__m128i *)(s + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i *)(s + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    hex_encode_scalar(s + 2 * i, p + i, len - i);
+}
+
+#endif /* __SSE2__ */
+
+#if defined(__x86_64__) && defined(USE_AVX2)
+
+#define HEX_AVX2 __attribute__((target("avx2")))
+
+static HEX_AVX2 inline __m256i hex_values_avx2(__m256i c, __m256i *bad)
+{
+    const __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    const __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    const __m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+    const __m256i is_l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+
+    *bad = _mm256_or_si256(*bad, _mm256_andnot_si256(_mm256_or_si256(is_d, is_l), _mm256_set1_epi8(-1)));
+    return _mm256_or_si256(_mm256_and_si256(is_d, d),
+                           _mm256_and_si256(is_l, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+static HEX_AVX2 inline __m256i hex_pack_avx2(__m256i v)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, _mm256_set1_epi16(0x00ff)), 4),
+                           _mm256_srli_epi16(v, 8));
+}
+
+static HEX_AVX2 inline __m256i hex_chars_avx2(__m256i n)
+{
+    const __m256i gt9 = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+
+    return _mm256_add_epi8(_mm256_add_epi8(n, _mm256_set1_epi8('0')),
+                           _mm256_and_si256(gt9, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+static HEX_AVX2 bool hex_decode_avx2(unsigned char *p, const char *hexstr, size_t len)
+{
+    __m256i bad = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i v0 = hex_values_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + 2 * i)), &bad);
+        __m256i v1 = hex_values_avx2(_mm256_loadu_si256((const __m256i *)(hexstr + 2 * i + 32)), &bad);
+        /* packus works within 128-bit halves, put the quadwords back in order */
+        __m256i b = _mm256_packus_epi16(hex_pack_avx2(v0), hex_pack_avx2(v1));
+
+        _mm256_storeu_si256((__m256i *)(p + i), _mm256_permute4x64_epi64(b, 0xd8));
+    }
+    if (_mm256_movemask_epi8(bad))
+        return false;
+    return hex_decode_sse2(p + i, hexstr + 2 * i, len - i);
+}
+
+static HEX_AVX2 void hex_encode_avx2(char *s, const unsigned char *p, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hi = hex_chars_avx2(_mm256_and_si256(_mm256_srli_epi16(b, 4), mask));
+        __m256i lo = hex_chars_avx2(_mm256_and_si256(b, mask));
+        __m256i c0 = _mm256_unpacklo_epi8(hi, lo); /* bytes 0-7 and 16-23 */
+        __m256i c1 = _mm256_unpackhi_epi8(hi, lo); /* bytes 8-15 and 24-31 */
+
+        _mm256_storeu_si256((__m256i *)(s + 2 * i), _mm256_permute2x128_si256(c0, c1, 0x20));
+        _mm256_storeu_si256((__m256i *)(s + 2 * i + 32), _mm256_permute2x128_si256(c0, c1, 0x31));
+    }
+    hex_encode_sse2(s + 2 * i, p + i, len - i);
+}
+
+static bool avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif /* __x86_64__ && USE_AVX2 */
+
+static bool always_supported(void)
+{
+    return true;
+}
+
+static const struct {
+    struct hex_codec codec;
+    bool (*supported)(void);
+} hex_codecs[] = {
+#if defined(__x86_64__) && defined(USE_AVX2)
+    { { "avx2", hex_decode_avx2, hex_encode_avx2 }, avx2_supported },
+#endif
+#if defined(__SSE2__)
+    { { "sse2", hex_decode_sse2, hex_encode_sse2 }, always_supported },
+#endif
+    { { "scalar", hex_decode_scalar, hex_encode_scalar }, always_supported },
+};
+
+/* Codecs this CPU runs, fastest first; NULL past the last */
+const struct hex_codec *hex_codec_get(unsigned idx)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE(hex_codecs); i++) {
+        if (!hex_codecs[i].supported())
+            continue;
+        if (!idx--)
+            return &hex_codecs[i].codec;
+    }
+    return NULL;
+}
+
+/* Short strings go straight to the scalar loop, the vector setup costs more */
+#define HEX_SIMD_MIN 32
+
+static const struct hex_codec *hex_best(size_t len)
+{
+    static const struct hex_codec *best;
+
+    if (len < HEX_SIMD_MIN)
+        return &hex_codecs[ARRAY_SIZE(hex_codecs) - 1].codec;
+    if (!best)
+        best = hex_codec_get(0);
+    return best;
+}
+
+/* Decodes exactly 2 * len hex characters into len bytes */
+bool hex_decode(unsigned char *p, const char *hexstr, size_t len)
+{
+    return hex_best(len)->decode(p, hexstr, len);
+}
+
+/* Writes 2 * len lowercase hex characters, without a terminator */
+void hex_encode(char *s, const unsigned char *p, size_t len)
+{
+    hex_best(len)->encode(s, p, len);
+}
@@ -201,8 +201,85 @@ extern int scanhash_cryptonight(int thr_id, uint32_t *pdata, const uint32_t *pta
 
 extern void wild_keccak_hash_dbl_use_global_scratch(const uint8_t *in, size_t inlen, uint8_t *md);
 
-extern int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const uint32_t *ptarget,
-                               uint32_t max_nonce, unsigned long *hashes_done);
+extern bool wild_keccak_lanes_valid(int lanes);
+extern bool wild_keccak_set_kernel(const char *name);
+extern const char *wild_keccak_kernel_name(void);
+extern bool wild_keccak_kernel_info(unsigned idx, const char **name, int *lanes, bool *supported);
+extern bool wild_keccak_line_indices(unsigned idx, uint64_t *out, const uint64_t *w, size_t n, uint64_t lines);
+
+/*
+ * What a job blob fixes of the first WildKeccak permutation.  A blob
+ * shorter than a block is absorbed in one go and its nonce (bytes 1-4)
+ * only lands in state word 0, so the padded block, four of the five theta
+ * column parities and 14 of the 25 rho-pi outputs are the same for every
+ * nonce.  Built once per job; each hash only finishes what word 0 reaches.
+ */
+struct wk_midstate {
+    uint64_t w0;        /* state word 0 with the nonce bytes zero */
+    uint64_t c0;        /* parity of column 0 less word 0 */
+    uint64_t r2;        /* rotl(t[2], 1), the rest of theta D[0] */
+    uint64_t t3;        /* parity of column 3, the rest of theta D[3] */
+    uint64_t bc4;       /* theta D[4] */
+    uint64_t s[25];     /* the absorbed block */
+    uint64_t b[25];     /* rho-pi outputs that word 0 does not reach */
+};
+
+extern bool wild_keccak_midstate_init(struct wk_midstate *mid, const uint8_t *blob, size_t len);
+
+/* A job that found shares still refer to; freed with the last reference */
+struct work_ref {
+    struct work *work;
+    int refs;
+};
+
+struct scan_result {
+    struct work_ref *job;
+    uint64_t nonce;             /* all 8 nonce bytes at data + 1 */
+    uint32_t hash[8];
+};
+
+#define RESULT_RING_SIZE 64 /* power of two */
+
+/*
+ * Shares found by one miner thread.  scanhash_wildkeccak fills it while it
+ * keeps hashing and the workio thread, woken through notify, submits them.
+ */
+struct result_ring {
+    struct scan_result slot[RESULT_RING_SIZE];
+    unsigned head;              /* written by the miner thread only */
+    unsigned tail;              /* written by the drainer only */
+    struct work_ref *job;       /* job of the nonces being scanned */
+    void (*notify)(struct result_ring *ring);
+};
+
+extern bool result_ring_push(struct result_ring *ring, uint64_t nonce, const uint32_t *hash);
+extern bool result_ring_pop(struct result_ring *ring, struct scan_result *res);
+
+/*
+ * mid is built from pdata by wild_keccak_midstate_init.  Only the low half
+ * of the nonce is scanned, the high half at pdata + 5 is part of mid.
+ * Without a ring the scan returns at the first share with its nonce in
+ * pdata.  With one it records every share and carries on to max_nonce,
+ * stopping early only when the ring is full; it returns the number of
+ * shares recorded.
+ */
+extern int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const struct wk_midstate *mid,
+                               const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done,
+                               struct result_ring *ring);
+
+struct bench_params {
+    int threads;            /* 0 sweeps powers of two up to max_threads */
+    int max_threads;
+    const char *kernel;     /* NULL or "auto" sweeps every supported kernel */
+    int lanes;              /* 0 sweeps every lane count a kernel accepts */
+    int size_mb;            /* synthetic scratchpad size */
+    int seconds;            /* run time of each configuration */
+    const char *json_file;  /* NULL prints the JSON report after the table */
+};
+
+extern bool run_bench_suite(const struct bench_params *params);
+extern bool run_hex_bench(const struct bench_params *params);
+extern bool run_index_bench(const struct bench_params *params);
 
 
 struct thr_info {
@@ -220,6 +297,9 @@ extern bool opt_debug;
 extern bool opt_protocol;
 extern bool opt_redirect;
 extern int opt_timeout;
+extern int opt_lanes;
+extern int opt_prefetch_distance;
+extern int opt_prefetch_hint;
 extern bool want_longpoll;
 extern bool have_longpoll;
 extern bool want_stratum;
@@ -236,7 +316,12 @@ extern struct work_restart *work_restart;
 extern bool jsonrpc_2;
 extern char rpc2_id[65];
 
-#define WILD_KECCAK_SCRATCHPAD_BUFFSIZE  (345<<20)
+/* Address space reserved for the scratchpad; pages are committed as it grows */
+#if UINTPTR_MAX > 0xffffffffU
+#define WILD_KECCAK_SCRATCHPAD_BUFFSIZE  ((size_t)64 << 30)
+#else
+#define WILD_KECCAK_SCRATCHPAD_BUFFSIZE  ((size_t)1 << 30)
+#endif
 struct  __attribute__((__packed__)) scratchpad_hi
 {
     unsigned char prevhash[32];
@@ -244,6 +329,9 @@ struct  __attribute__((__packed__)) scratchpad_hi
 };
 
 #define WILD_KECCAK_ADDENDUMS_ARRAY_SIZE  10
+#define WILD_KECCAK_MAX_LANES  8 /* nonces hashed together by one miner thread */
+#define WILD_KECCAK_DEFAULT_LANES  4
+#define WILD_KECCAK_DEFAULT_PREFETCH_DISTANCE 1
 #define LOCAL_SCRATCHPAD_CACHE_EXPIRATION_INTERVAL 60*60*24*3   //3 days
 
 
@@ -261,11 +349,148 @@ struct __attribute__((__packed__)) scratchpad_file_header
     uint64_t scratchpad_size;
 };
 
+/* Written by this miner right after scratchpad_file_header.  Files served
+ * for download lack it and keep the data right after the header. */
+#define SCRATCHPAD_FILE_MAGIC        "WKSCRP02"
+#define SCRATCHPAD_FILE_DATA_OFFSET  65536 /* a page boundary for every page size up to 64 KB */
+#define SCRATCHPAD_FILE_DIRTY        1     /* mapped data is being changed, header not current */
+#define SCRATCHPAD_FILE_CHECKSUMS    2     /* scratchpad_file_sums follows the extension */
+#define SCRATCHPAD_FILE_PARTIAL      4     /* <cache>.part: a byte per chunk downloaded follows the extension */
+#define SCRATCHPAD_FILE_CHUNK        (2 << 20)
+
+struct __attribute__((__packed__)) scratchpad_file_ext
+{
+    char magic[8];
+    uint64_t data_offset;
+    uint64_t flags;
+};
+
+/* Followed by an spio_sum per SCRATCHPAD_FILE_CHUNK of data, up to where the data starts */
+struct __attribute__((__packed__)) scratchpad_file_sums
+{
+    uint64_t chunk_size;
+    uint64_t chunks;
+};
+
+#define SCRATCHPAD_FILE_MAX_CHUNKS ((SCRATCHPAD_FILE_DATA_OFFSET - sizeof(struct scratchpad_file_header) - \
+    sizeof(struct scratchpad_file_ext) - sizeof(struct scratchpad_file_sums)) / 8)
+
+/* <cache>.journal: addenda applied and popped since the cache file was
+ * last written, replayed on top of it at start */
+#define SCRATCHPAD_JOURNAL_MAGIC         "WKJRNL01"
+#define SCRATCHPAD_JOURNAL_COMPACT_SIZE  (16<<20) /* rewrite the cache file past this */
+#define SCRATCHPAD_JOURNAL_ADD           1 /* followed by entry.add_size words */
+#define SCRATCHPAD_JOURNAL_POP           2
+
+struct __attribute__((__packed__)) scratchpad_journal_header
+{
+    char magic[8];
+    struct scratchpad_hi base_hi; /* current_hi of the cache file it extends */
+};
+
+struct __attribute__((__packed__)) scratchpad_journal_record
+{
+    uint32_t type;
+    struct addendums_array_entry entry;
+    struct scratchpad_hi hi;       /* current_hi after the record */
+    uint64_t checksum;             /* FNV-1a of the record, this field zero, and its data */
+};
+
+/* <cache>.rollback: entries of the addenda below current_hi, oldest first,
+ * reaching further back than add_arr */
+#define SCRATCHPAD_ROLLBACK_MAGIC        "WKRBCK01"
+#define SCRATCHPAD_ROLLBACK_DEPTH        1440 /* blocks kept, two days of them */
+#define SCRATCHPAD_CHECKPOINT_INTERVAL   5    /* blocks between writes, fewer than add_arr holds */
+
+struct __attribute__((__packed__)) scratchpad_rollback_header
+{
+    char magic[8];
+    struct scratchpad_hi hi;       /* current_hi the last entry leads up to */
+    uint64_t count;
+};
+
 
 extern volatile bool stratum_have_work;
 extern volatile bool need_to_rerequest_job;
 extern uint64_t* pscratchpad_buff;
 extern volatile uint64_t scratchpad_size;
+extern bool scratchpad_commit(size_t bytes);
+extern uint32_t scratchpad_seq;
+extern bool scratchpad_state(struct scratchpad_file_header *fh);
+extern void scratchpad_begin_update(void);
+extern void scratchpad_end_update(void);
+
+/* pages.c: scratchpad page types, in fallback order */
+enum { PAGES_4K, PAGES_THP, PAGES_2M, PAGES_1G, PAGES_MAX };
+extern int opt_pages;
+extern const char *pages_name(int type);
+extern bool pages_parse(const char *arg, int *type);
+extern void *pages_alloc(size_t size, int *type, bool fallback);
+extern void pages_free(void *p, size_t size, int type);
+extern void pages_report(const char *what, const void *p, size_t size, int type);
+
+/* Reserved address space, backed from the start as far as committed */
+struct pages_region {
+    uint8_t *base;
+    size_t reserved;
+    size_t committed;
+    int type;                   /* page type of the latest commit */
+    bool lazy;                  /* commit without faulting in, the caller touches first */
+    bool shared;                /* huge pages from a memfd that outlives an exec (Linux) */
+    int fd;                     /* that memfd, -1 while there is none */
+    int fd_type;                /* page type of the memfd */
+    size_t fd_bytes;            /* start of the region the memfd backs */
+};
+extern bool pages_reserve(struct pages_region *r, size_t size, int type);
+extern bool pages_commit(struct pages_region *r, size_t size, bool fallback);
+extern int pages_handoff(struct pages_region *r, size_t size, int *type);
+extern bool pages_adopt(struct pages_region *r, int fd, int type);
+extern void pages_release(struct pages_region *r);
+extern void pages_region_report(const char *what, const struct pages_region *r);
+
+/* spio.c: the data part of a scratchpad file, on several threads */
+struct spio {
+    int fd;                     /* the file, read or written past offset */
+    const char *name;           /* for messages */
+    uint64_t offset;            /* file offset of buf */
+    uint8_t *buf;
+    size_t bytes;
+    int threads;                /* requested, then the number used */
+    bool uncached;              /* keep it out of the page cache, O_DIRECT where allowed */
+    void (*thread_init)(int idx); /* run first on every I/O thread */
+    uint64_t *sums;             /* when set, the spio_sum of every SCRATCHPAD_FILE_CHUNK;
+                                 * reads then zero-fill past the end of a short file */
+    bool direct;                /* out: all of the aligned part went direct */
+    long long usec;             /* out */
+    long long sum_usec;         /* out: checksum time, all threads together */
+};
+extern uint64_t spio_sum(const void *p, size_t len);
+extern bool spio_read(struct spio *io);
+extern bool spio_write(struct spio *io);
+extern void spio_report(const char *what, const struct spio *io);
+
+/* shm.c */
+extern bool shm_writer;             /* this process applies addenda to the segment */
+extern uint64_t *shm_attach(const char *name);
+extern bool shm_read(struct scratchpad_file_header *fh);
+extern void shm_begin(void);
+extern void shm_publish(const struct scratchpad_file_header *fh);
+extern bool shm_try_promote(void);
+extern bool shm_commit(size_t bytes);
+
+/* seed.c */
+extern bool seed_start(const char *arg);
+
+/* numa.c */
+extern int numa_nodes;              /* replicas in use, 0 without --numa */
+extern uint64_t **pscratchpad_thr;  /* per-thread replica, NULL without --numa */
+extern bool numa_init(int n_threads);
+extern int numa_thread_node(int thr_id);
+extern int numa_node_id(int idx);
+extern void numa_bind_thread(int thr_id);
+extern uint64_t *numa_replica(int idx);
+extern bool numa_commit_replicas(size_t bytes);
+extern void numa_sync_replicas(uint64_t offset, uint64_t count);
 extern struct scratchpad_hi current_scratchpad_hi;
 
 #define JSON_RPC_LONGPOLL	(1 << 0)
@@ -278,11 +503,21 @@ extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 extern size_t hex2bin_len(unsigned char *p, const char *hexstr, size_t len);
+
+struct hex_codec {
+    const char *name;
+    bool (*decode)(unsigned char *p, const char *hexstr, size_t len);
+    void (*encode)(char *s, const unsigned char *p, size_t len);
+};
+
+extern const struct hex_codec *hex_codec_get(unsigned idx);
+extern bool hex_decode(unsigned char *p, const char *hexstr, size_t len);
+extern void hex_encode(char *s, const unsigned char *p, size_t len);
 extern int timeval_subtract(struct timeval *result, struct timeval *x,
 struct timeval *y);
 extern bool fulltest(const uint32_t *hash, const uint32_t *target);
 extern void diff_to_target(uint32_t *target, double diff);
-extern bool rpc2_getfullscratchpad_decode(const json_t *val);
+extern bool rpc2_getfullscratchpad_decode(const json_t *val, size_t len);
 
 
 struct work {
@@ -0,0 +1,255 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// --numa: one scratchpad replica per NUMA node, with every miner thread
+// bound to the CPUs of a node and hashing against that node's replica.
+// Topology comes from sysfs and placement from first touch, so no libnuma
+// is needed.  pscratchpad_buff stays the master copy that the scratchpad
+// file, downloads and addenda go through.
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#include "miner.h"
+#include "xmalloc.h"
+
+int numa_nodes = 0;
+uint64_t **pscratchpad_thr = NULL;
+
+#if defined(__linux__)
+
+struct numa_node {
+    int id;
+    cpu_set_t cpus;
+    struct pages_region region;
+};
+
+static struct numa_node *nodes;
+static int *thr_node;
+
+/* Parses a sysfs list such as "0-3,8-11" and calls fn for every member */
+static bool parse_list(const char *s, void (*fn)(int, void *), void *arg)
+{
+    char *end;
+    long a, b;
+
+    while (*s && *s != '\n') {
+        a = strtol(s, &end, 10);
+        if (end == s || a < 0)
+            return false;
+        b = a;
+        s = end;
+        if (*s == '-') {
+            s++;
+            b = strtol(s, &end, 10);
+            if (end == s || b < a)
+                return false;
+            s = end;
+        }
+        for (; a <= b; a++)
+            fn((int)a, arg);
+        if (*s == ',')
+            s++;
+    }
+    return true;
+}
+
+static bool read_sysfs_line(const char *path, char *buf, size_t len)
+{
+    FILE *fp = fopen(path, "r");
+    bool ok;
+
+    if (!fp)
+        return false;
+    ok = fgets(buf, len, fp) != NULL;
+    fclose(fp);
+    return ok;
+}
+
+static void add_cpu(int cpu, void *arg)
+{
+    if (cpu < CPU_SETSIZE)
+        CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+static void add_node(int id, void *arg)
+{
+    char path[64], buf[1024];
+    struct numa_node *n;
+
+    (void)arg;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+    if (!read_sysfs_line(path, buf, sizeof(buf)))
+        return;
+    nodes = xrealloc(nodes, numa_nodes + 1, sizeof(*nodes));
+    n = &nodes[numa_nodes];
+    memset(n, 0, sizeof(*n));
+    n->id = id;
+    CPU_ZERO(&n->cpus);
+    if (!parse_list(buf, add_cpu, &n->cpus) || !CPU_COUNT(&n->cpus))
+        return; /* memory-only node, nothing runs there */
+    numa_nodes++;
+}
+
+static void *replica_thread(void *arg)
+{
+    struct numa_node *n = arg;
+    char what[64];
+
+    /* running on the node, so populating and copying place every page there */
+    sched_setaffinity(0, sizeof(n->cpus), &n->cpus);
+    if (!pages_reserve(&n->region, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, opt_pages))
+        return NULL;
+    if (!pages_commit(&n->region, scratchpad_size * 8, true)) {
+        pages_release(&n->region);
+        return NULL;
+    }
+    memcpy(n->region.base, pscratchpad_buff, scratchpad_size * 8);
+    snprintf(what, sizeof(what), "Scratchpad replica on node %d", n->id);
+    pages_region_report(what, &n->region);
+    return NULL;
+}
+
+bool numa_init(int n_threads)
+{
+    char buf[1024];
+    pthread_t *pth;
+    int i;
+
+    if (!read_sysfs_line("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+        !parse_list(buf, add_node, NULL)) {
+        applog(LOG_ERR, "NUMA topology not found in /sys/devices/system/node");
+        return false;
+    }
+    if (numa_nodes < 2) {
+        applog(LOG_INFO, "Only one NUMA node with CPUs, --numa has no effect");
+        numa_nodes = 0;
+        return true;
+    }
+
+    pth = xcalloc(numa_nodes, sizeof(*pth));
+    for (i = 0; i < numa_nodes; i++) {
+        if (pthread_create(&pth[i], NULL, replica_thread, &nodes[i])) {
+            applog(LOG_ERR, "NUMA replica thread create failed");
+            return false;
+        }
+    }
+    for (i = 0; i < numa_nodes; i++)
+        pthread_join(pth[i], NULL);
+    free(pth);
+    for (i = 0; i < numa_nodes; i++) {
+        if (!nodes[i].region.base) {
+            applog(LOG_ERR, "Failed to allocate scratchpad replica on NUMA node %d", nodes[i].id);
+            return false;
+        }
+    }
+
+    thr_node = xcalloc(n_threads, sizeof(*thr_node));
+    pscratchpad_thr = xcalloc(n_threads, sizeof(*pscratchpad_thr));
+    for (i = 0; i < n_threads; i++) {
+        thr_node[i] = i % numa_nodes;
+        pscratchpad_thr[i] = (uint64_t *)nodes[thr_node[i]].region.base;
+    }
+    applog(LOG_INFO, "Scratchpad replicated on %d NUMA nodes", numa_nodes);
+    return true;
+}
+
+/* index of the replica thr_id hashes against */
+int numa_thread_node(int thr_id)
+{
+    return thr_node[thr_id];
+}
+
+/* kernel node number of replica idx, for log messages */
+int numa_node_id(int idx)
+{
+    return nodes[idx].id;
+}
+
+void numa_bind_thread(int thr_id)
+{
+    struct numa_node *n = &nodes[thr_node[thr_id]];
+
+    sched_setaffinity(0, sizeof(n->cpus), &n->cpus);
+}
+
+uint64_t *numa_replica(int idx)
+{
+    return (uint64_t *)nodes[idx].region.base;
+}
+
+/*
+ * Grows every replica to bytes ahead of an addendum.  The calling thread
+ * moves to each node in turn so the new pages are first touched there.
+ */
+bool numa_commit_replicas(size_t bytes)
+{
+    cpu_set_t saved;
+    bool ok = true;
+    int i;
+
+    if (!numa_nodes)
+        return true;
+    sched_getaffinity(0, sizeof(saved), &saved);
+    for (i = 0; i < numa_nodes && ok; i++) {
+        sched_setaffinity(0, sizeof(nodes[i].cpus), &nodes[i].cpus);
+        ok = pages_commit(&nodes[i].region, bytes, true);
+    }
+    sched_setaffinity(0, sizeof(saved), &saved);
+    if (!ok)
+        applog(LOG_ERR, "Failed to grow the scratchpad replica on NUMA node %d", nodes[i - 1].id);
+    return ok;
+}
+
+#else /* !__linux__ */
+
+bool numa_init(int n_threads)
+{
+    applog(LOG_INFO, "--numa is only supported on Linux, using a single scratchpad");
+    return true;
+}
+
+int numa_thread_node(int thr_id)
+{
+    return 0;
+}
+
+int numa_node_id(int idx)
+{
+    return 0;
+}
+
+void numa_bind_thread(int thr_id)
+{
+}
+
+uint64_t *numa_replica(int idx)
+{
+    return NULL;
+}
+
+bool numa_commit_replicas(size_t bytes)
+{
+    return true;
+}
+
+#endif
+
+/* Copies count words at offset from the master scratchpad into every replica */
+void numa_sync_replicas(uint64_t offset, uint64_t count)
+{
+    int i;
+
+    for (i = 0; i < numa_nodes; i++)
+        memcpy(numa_replica(i) + offset, pscratchpad_buff + offset, count * 8);
+}
@@ -0,0 +1,555 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Scratchpad memory with a page size picked by --pages.  Every hash makes
+// ~72 random reads over the whole scratchpad, so the TLB reach of the
+// backing pages matters more than anything else about the allocation.
+// The chain runs 1 GB hugetlb -> 2 MB hugetlb -> transparent huge pages
+// -> 4 KB pages, starting wherever --pages points.
+//
+// The mining scratchpad lives in a region: address space for the largest
+// scratchpad we accept is reserved up front and pages are committed as the
+// chain grows into it, so memory use follows the actual scratchpad size.
+// A shared region backs its hugetlb steps, and transparent huge pages
+// where shmem gets them, with a memfd instead of anonymous memory.  A hot
+// restart hands that to the new image to map as it is, and copies into a
+// fresh memfd only what anonymous pages hold.
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <strings.h>
+#if !defined(_WIN64) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#endif
+#include "miner.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 4U
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB MAP_HUGE_2MB /* same encoding */
+#endif
+#ifndef MFD_HUGE_1GB
+#define MFD_HUGE_1GB MAP_HUGE_1GB
+#endif
+
+int opt_pages = PAGES_1G;
+
+static const struct {
+    const char *name;
+    size_t size;
+} page_types[] = {
+    [PAGES_4K]  = { "4k",  4096 },
+    [PAGES_THP] = { "thp", 2 << 20 },
+    [PAGES_2M]  = { "2m",  2 << 20 },
+    [PAGES_1G]  = { "1g",  1 << 30 },
+};
+
+const char *pages_name(int type)
+{
+    return page_types[type].name;
+}
+
+bool pages_parse(const char *arg, int *type)
+{
+    int i;
+
+    if (!strcasecmp(arg, "auto")) {
+        *type = PAGES_1G;
+        return true;
+    }
+    for (i = 0; i < PAGES_MAX; i++) {
+        if (!strcasecmp(arg, page_types[i].name)) {
+            *type = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t pages_round(size_t size, int type)
+{
+    size_t pg = page_types[type].size;
+
+    return (size + pg - 1) / pg * pg;
+}
+
+/* Regions grow in huge-page steps, whole 1 GB pages when they back them */
+static size_t region_unit(int type)
+{
+    return type == PAGES_1G ? page_types[PAGES_1G].size : page_types[PAGES_2M].size;
+}
+
+#if !defined(_WIN64) && !defined(_WIN32)
+
+static void *map_hugetlb(size_t size, int flag)
+{
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE | flag, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void *map_thp(size_t size)
+{
+    const size_t align = page_types[PAGES_THP].size;
+    uint8_t *p, *aligned;
+    size_t i;
+
+    /* over-map so the region can start on a huge page boundary */
+    p = mmap(0, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    aligned = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + size, p + align - aligned);
+
+    if (madvise(aligned, size, MADV_HUGEPAGE)) {
+        munmap(aligned, size);
+        return NULL;
+    }
+    /* populate after the madvise, or the faults are served with 4k pages */
+    for (i = 0; i < size; i += 4096)
+        aligned[i] = 0;
+    return aligned;
+}
+
+static void *map_4k(size_t size)
+{
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+        return NULL;
+#ifdef MADV_NOHUGEPAGE
+    madvise(p, size, MADV_NOHUGEPAGE);
+#endif
+    memset(p, 0, size);
+    return p;
+}
+
+/* kB of the mapping at p that the kernel backs with transparent huge pages */
+static size_t thp_backed(const void *p)
+{
+    char line[256];
+    uintptr_t start, end;
+    bool found = false;
+    size_t kb = 0;
+    FILE *fp = fopen("/proc/self/smaps", "r");
+
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &start, &end) == 2) {
+            found = start == (uintptr_t)p;
+            continue;
+        }
+        if (found && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                      sscanf(line, "ShmemPmdMapped: %zu kB", &kb) == 1) && kb)
+            break;
+    }
+    fclose(fp);
+    return kb;
+}
+
+static void *pages_map(size_t size, int type)
+{
+    switch (type) {
+    case PAGES_1G: return map_hugetlb(size, MAP_HUGE_1GB);
+    case PAGES_2M: return map_hugetlb(size, MAP_HUGE_2MB);
+    case PAGES_THP: return map_thp(size);
+    default: return map_4k(size);
+    }
+}
+
+/*
+ * Reserves size bytes of address space, aligned for every page type.
+ * Nothing is backed until pages_commit.
+ */
+bool pages_reserve(struct pages_region *r, size_t size, int type)
+{
+    const size_t align = page_types[PAGES_1G].size;
+    uint8_t *p, *aligned;
+
+    memset(r, 0, sizeof(*r));
+    size = pages_round(size, PAGES_1G);
+    p = mmap(0, size + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    aligned = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (aligned > p)
+        munmap(p, aligned - p);
+    munmap(aligned + size, p + align - aligned);
+
+    r->base = aligned;
+    r->reserved = size;
+    r->type = type;
+    r->fd = -1;
+    return true;
+}
+
+#if defined(__linux__)
+static unsigned memfd_flags(int type)
+{
+    switch (type) {
+    case PAGES_1G: return MFD_HUGETLB | MFD_HUGE_1GB;
+    case PAGES_2M: return MFD_HUGETLB | MFD_HUGE_2MB;
+    default: return 0;
+    }
+}
+
+/* Whether a memfd gets transparent huge pages, most distributions ship shmem THP off */
+static bool shmem_thp(void)
+{
+    static int on = -1;
+    char buf[128] = "";
+    FILE *fp;
+
+    if (on < 0) {
+        fp = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+        if (fp) {
+            if (!fgets(buf, sizeof(buf), fp))
+                buf[0] = 0;
+            fclose(fp);
+        }
+        on = strstr(buf, "[always]") || strstr(buf, "[within_size]") ||
+             strstr(buf, "[advise]") || strstr(buf, "[force]");
+    }
+    return on;
+}
+
+/*
+ * region_map for a step of a shared region that continues its memfd, which
+ * is created by the first such step with the page size of type and keeps
+ * it.  Only page types a memfd backs as well as anonymous memory qualify.
+ */
+static bool region_map_shared(struct pages_region *r, uint8_t *p, size_t len, int type, bool lazy)
+{
+    const off_t off = p - r->base;
+    bool created = false;
+    size_t i;
+
+    if ((size_t)off != r->fd_bytes ||
+        (type != PAGES_1G && type != PAGES_2M && (type != PAGES_THP || !shmem_thp())))
+        return false;
+    if (r->fd >= 0 && memfd_flags(type) != memfd_flags(r->fd_type))
+        return false;
+    if (r->fd < 0) {
+        r->fd = memfd_create("minerd-scratchpad", memfd_flags(type));
+        if (r->fd < 0)
+            return false;
+        created = true;
+    }
+    /* the file grows last, so a failed step leaves it as long as what is mapped */
+    if (mmap(p, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, r->fd, off) == MAP_FAILED ||
+        (type == PAGES_THP && madvise(p, len, MADV_HUGEPAGE)) || ftruncate(r->fd, off + len))
+        goto fail;
+    if (!lazy)
+        for (i = 0; i < len; i += 4096)
+            p[i] = 0;
+    r->fd_type = type;
+    r->fd_bytes = off + len;
+    return true;
+
+fail:
+    /* back to reserved, for anonymous pages to take the step instead */
+    mmap(p, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    if (created) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    return false;
+}
+#endif
+
+/*
+ * Backs len bytes at p, inside the reservation, with pages of type, faulted
+ * in unless lazy.  hugetlb pages are reserved by the mmap either way.
+ */
+static bool region_map(struct pages_region *r, uint8_t *p, size_t len, int type, bool lazy)
+{
+    size_t i;
+
+#if defined(__linux__)
+    if (r->shared && region_map_shared(r, p, len, type, lazy))
+        return true;
+#endif
+
+    switch (type) {
+    case PAGES_1G:
+    case PAGES_2M:
+        if (mmap(p, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB | (lazy ? 0 : MAP_POPULATE) |
+                 (type == PAGES_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB), -1, 0) != MAP_FAILED)
+            return true;
+        /* a failed MAP_FIXED may already have dropped the reservation there */
+        mmap(p, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        return false;
+    case PAGES_THP:
+        if (mprotect(p, len, PROT_READ | PROT_WRITE))
+            return false;
+        if (madvise(p, len, MADV_HUGEPAGE)) {
+            mprotect(p, len, PROT_NONE);
+            return false;
+        }
+        break;
+    default:
+        if (mprotect(p, len, PROT_READ | PROT_WRITE))
+            return false;
+#ifdef MADV_NOHUGEPAGE
+        madvise(p, len, MADV_NOHUGEPAGE);
+#endif
+        break;
+    }
+    if (!lazy)
+        for (i = 0; i < len; i += 4096)
+            p[i] = 0;
+    return true;
+}
+
+/*
+ * Grows what is backed at the start of the region to at least size bytes.
+ * With fallback a step that cannot get pages of r->type takes the next
+ * smaller type, which the rest of the region then keeps using.
+ */
+bool pages_commit(struct pages_region *r, size_t size, bool fallback)
+{
+    size_t end, len;
+    int t;
+
+    if (size <= r->committed)
+        return true;
+    if (size > r->reserved)
+        return false;
+    for (t = r->type; t >= 0; t--) {
+        end = (size + region_unit(t) - 1) / region_unit(t) * region_unit(t);
+        if (end > r->reserved)
+            end = r->reserved;
+        len = end - r->committed;
+        if (region_map(r, r->base + r->committed, len, t, r->lazy)) {
+            if (t != r->type && r->committed)
+                applog(LOG_INFO, "%s pages not available past %zu MB, fell back to %s",
+                       page_types[r->type].name, r->committed >> 20, page_types[t].name);
+            else if (t != r->type)
+                applog(LOG_INFO, "%s pages not available, fell back to %s",
+                       page_types[r->type].name, page_types[t].name);
+            r->type = t;
+            r->committed = end;
+            return true;
+        }
+        if (!fallback)
+            break;
+    }
+    return false;
+}
+
+#if defined(__linux__)
+/*
+ * A memfd holding the first size bytes of r for a hot restart: the
+ * region's own where it backs them, with *type set to their page type,
+ * else a copy, with *type set to -1.  Returns -1 on failure.
+ */
+int pages_handoff(struct pages_region *r, size_t size, int *type)
+{
+    void *p;
+    int fd;
+
+    if (r->fd >= 0 && r->fd_bytes >= size) {
+        *type = r->fd_type;
+        return r->fd;
+    }
+    fd = memfd_create("minerd-scratchpad", 0);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) ||
+        (p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    memcpy(p, r->base, size);
+    munmap(p, size);
+    *type = -1;
+    return fd;
+}
+
+/*
+ * Takes over what pages_handoff gave the image before a hot restart: maps
+ * the memfd over the start of r as it is, or for a copy (type -1) commits
+ * r as usual and copies it in.  Closes fd unless r keeps it.
+ */
+bool pages_adopt(struct pages_region *r, int fd, int type)
+{
+    struct stat st;
+    void *p;
+    bool ok;
+
+    if (fstat(fd, &st) || (size_t)st.st_size > r->reserved || type >= PAGES_MAX) {
+        close(fd);
+        return false;
+    }
+    if (type < 0) {
+        ok = pages_commit(r, st.st_size, true);
+        p = ok && st.st_size ? mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+        if (p == MAP_FAILED)
+            ok = false;
+        else if (p) {
+            memcpy(r->base, p, st.st_size);
+            munmap(p, st.st_size);
+        }
+        close(fd);
+        return ok;
+    }
+    if (st.st_size && mmap(r->base, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                           fd, 0) == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    if (type == PAGES_THP)
+        madvise(r->base, st.st_size, MADV_HUGEPAGE);
+    r->shared = true;
+    r->fd = fd;
+    r->fd_type = type;
+    r->fd_bytes = st.st_size;
+    r->type = type;
+    r->committed = st.st_size;
+    return true;
+}
+#endif
+
+void pages_release(struct pages_region *r)
+{
+    if (r->base)
+        munmap(r->base, r->reserved);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+#else
+
+static void *pages_map(size_t size, int type)
+{
+    return type == PAGES_4K ? calloc(1, size) : NULL;
+}
+
+/* Regions here are plain 4 KB pages, reserved and committed with VirtualAlloc */
+bool pages_reserve(struct pages_region *r, size_t size, int type)
+{
+    memset(r, 0, sizeof(*r));
+    r->base = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+    if (!r->base)
+        return false;
+    r->reserved = size;
+    r->type = PAGES_4K;
+    return true;
+}
+
+bool pages_commit(struct pages_region *r, size_t size, bool fallback)
+{
+    const size_t unit = region_unit(PAGES_4K);
+    size_t end;
+
+    if (size <= r->committed)
+        return true;
+    if (size > r->reserved)
+        return false;
+    end = (size + unit - 1) / unit * unit;
+    if (end > r->reserved)
+        end = r->reserved;
+    if (!VirtualAlloc(r->base + r->committed, end - r->committed, MEM_COMMIT, PAGE_READWRITE))
+        return false;
+    r->committed = end;
+    return true;
+}
+
+void pages_release(struct pages_region *r)
+{
+    if (r->base)
+        VirtualFree(r->base, 0, MEM_RELEASE);
+    memset(r, 0, sizeof(*r));
+}
+
+#endif
+
+/*
+ * Allocates size bytes of zeroed, populated memory backed by pages of
+ * *type.  With fallback, smaller page types are tried in turn when *type
+ * cannot be had.  *type is updated to what was actually used.
+ */
+void *pages_alloc(size_t size, int *type, bool fallback)
+{
+    void *p;
+    int t;
+
+    for (t = *type; t >= 0; t--) {
+        p = pages_map(pages_round(size, t), t);
+        if (p) {
+            *type = t;
+            return p;
+        }
+        if (!fallback)
+            break;
+    }
+    return NULL;
+}
+
+void pages_free(void *p, size_t size, int type)
+{
+#if !defined(_WIN64) && !defined(_WIN32)
+    munmap(p, pages_round(size, type));
+#else
+    free(p);
+#endif
+}
+
+/* Logs what backs an allocation from pages_alloc */
+void pages_report(const char *what, const void *p, size_t size, int type)
+{
+    size_t rounded = pages_round(size, type);
+
+#if !defined(_WIN64) && !defined(_WIN32)
+    if (type == PAGES_THP) {
+        size_t huge = thp_backed(p) << 10;
+
+        applog(LOG_INFO, "%s: %zu MB with transparent huge pages, %zu x 2 MB pages in use, rest 4 KB",
+               what, rounded >> 20, huge / page_types[PAGES_THP].size);
+        return;
+    }
+#endif
+    applog(LOG_INFO, "%s: %zu MB in %zu x %s pages", what, rounded >> 20,
+           rounded / page_types[type].size, type == PAGES_1G ? "1 GB" : type == PAGES_2M ? "2 MB" : "4 KB");
+}
+
+/* Logs how much of a region is backed, and by what */
+void pages_region_report(const char *what, const struct pages_region *r)
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "%s (%zu MB reserved)", what, r->reserved >> 20);
+    pages_report(buf, r->base, r->committed, r->type);
+}
@@ -0,0 +1,510 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// --scratchpad-serve: the scratchpad of this miner over plain HTTP, as a
+// cache file with checksums, so the miners of a LAN can bootstrap from a
+// neighbour with -k instead of the internet.  Requests are answered from a
+// private copy taken between two addenda: the copy checks scratchpad_seq
+// before and after and starts over when an update came in between, so
+// neither the miner threads nor the thread applying addenda ever wait for
+// it.  The copy stays while peers keep asking, which keeps the ranges of
+// one download at one height, and is refreshed once they go quiet.
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#if !defined(_WIN64) && !defined(_WIN32)
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include "miner.h"
+#include "xmalloc.h"
+
+#if !defined(_WIN64) && !defined(_WIN32)
+
+#define SEED_MAX_PEERS      8       /* connections served at once */
+#define SEED_PIN_MS         10000   /* a stale copy is kept while peers asked this recently */
+#define SEED_IDLE_MS        60000   /* and dropped after this long without a request */
+#define SEED_COPY_TRIES     20
+#define SEED_TIMEOUT        30      /* seconds a peer may stall */
+#define SEED_REQUEST_MAX    8192
+
+struct seed_copy {
+    int refs;                       /* under seed_lock */
+    uint32_t seq;                   /* scratchpad_seq the copy was taken at */
+    struct scratchpad_hi hi;
+    uint64_t bytes;                 /* of data */
+    uint8_t *head;                  /* SCRATCHPAD_FILE_DATA_OFFSET bytes of header */
+    uint8_t *data;
+};
+
+static pthread_mutex_t seed_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct seed_copy *seed_cur;
+static long long seed_last_ms;
+static int seed_peers;
+
+static long long seed_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+/* Drops a reference, seed_lock held */
+static void seed_put(struct seed_copy *c)
+{
+    if (!c || --c->refs)
+        return;
+    free(c->head);
+    free(c->data);
+    free(c);
+}
+
+/*
+ * Copies the scratchpad and its state between two updates, then lays out
+ * the header area of a cache file for it.  NULL when there is none or
+ * the updates never left enough room.
+ */
+static struct seed_copy *seed_take(void)
+{
+    struct scratchpad_file_header fh;
+    struct scratchpad_file_ext ext = {SCRATCHPAD_FILE_MAGIC, SCRATCHPAD_FILE_DATA_OFFSET, 0};
+    struct scratchpad_file_sums sh = {SCRATCHPAD_FILE_CHUNK, 0};
+    struct seed_copy *c = xcalloc(1, sizeof(*c));
+    long long start = seed_ms();
+    uint64_t *sums, i;
+    int tries;
+
+    c->refs = 1;
+    for (tries = 0; tries < SEED_COPY_TRIES; tries++)
+    {
+        c->seq = __atomic_load_n(&scratchpad_seq, __ATOMIC_ACQUIRE);
+        if (c->seq & 1)
+        {
+            usleep(50000);
+            continue;
+        }
+        if (!scratchpad_state(&fh) || !fh.scratchpad_size)
+            break;
+        if (fh.scratchpad_size * 8 > c->bytes)
+        {
+            free(c->data);
+            c->data = malloc(fh.scratchpad_size * 8);
+            if (!c->data)
+            {
+                applog(LOG_ERR, "No memory for a %" PRIu64 " MB seed copy of the scratchpad",
+                       fh.scratchpad_size >> 17);
+                break;
+            }
+        }
+        c->bytes = fh.scratchpad_size * 8;
+        memcpy(c->data, pscratchpad_buff, c->bytes);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&scratchpad_seq, __ATOMIC_RELAXED) == c->seq)
+            goto copied;
+    }
+    seed_put(c);
+    return NULL;
+
+copied:
+    c->hi = fh.current_hi;
+    c->head = xcalloc(1, SCRATCHPAD_FILE_DATA_OFFSET);
+    sh.chunks = (c->bytes + SCRATCHPAD_FILE_CHUNK - 1) / SCRATCHPAD_FILE_CHUNK;
+    if (sh.chunks <= SCRATCHPAD_FILE_MAX_CHUNKS)
+    {
+        ext.flags |= SCRATCHPAD_FILE_CHECKSUMS;
+        sums = xmalloc(sh.chunks * 8);
+        for (i = 0; i < sh.chunks; i++)
+        {
+            uint64_t pos = i * SCRATCHPAD_FILE_CHUNK;
+
+            sums[i] = spio_sum(c->data + pos, pos + SCRATCHPAD_FILE_CHUNK < c->bytes ?
+                               SCRATCHPAD_FILE_CHUNK : c->bytes - pos);
+        }
+        memcpy(c->head + sizeof(fh) + sizeof(ext), &sh, sizeof(sh));
+        memcpy(c->head + sizeof(fh) + sizeof(ext) + sizeof(sh), sums, sh.chunks * 8);
+        free(sums);
+    }
+    memcpy(c->head, &fh, sizeof(fh));
+    memcpy(c->head + sizeof(fh), &ext, sizeof(ext));
+    applog(LOG_INFO, "Seed copy of the scratchpad at height %" PRIu64 ": %" PRIu64 " MB in %lld ms",
+           c->hi.height, c->bytes >> 20, seed_ms() - start);
+    return c;
+}
+
+/* The copy to answer a request from, taking a new one if it is stale and nobody is on the old one */
+static struct seed_copy *seed_get(void)
+{
+    struct seed_copy *c;
+    long long now = seed_ms();
+
+    pthread_mutex_lock(&seed_lock);
+    if (seed_cur && seed_cur->seq != __atomic_load_n(&scratchpad_seq, __ATOMIC_ACQUIRE) &&
+        now - seed_last_ms > SEED_PIN_MS)
+    {
+        seed_put(seed_cur);
+        seed_cur = NULL;
+    }
+    if (!seed_cur)
+        seed_cur = seed_take();
+    seed_last_ms = seed_ms();
+    c = seed_cur;
+    if (c)
+        c->refs++;
+    pthread_mutex_unlock(&seed_lock);
+    return c;
+}
+
+static bool seed_send(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t n;
+
+    while (len)
+    {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool seed_error(int fd, const char *status)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Length: 0\r\nRetry-After: 10\r\n\r\n", status);
+    return seed_send(fd, buf, strlen(buf));
+}
+
+/* The value of header name in the request, NULL if absent */
+static const char *seed_header(const char *req, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = req;
+
+    while ((p = strstr(p, "\r\n")) && p[2] != '\r')
+    {
+        p += 2;
+        if (!strncasecmp(p, name, len) && p[len] == ':')
+        {
+            p += len + 1;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * bytes=FROM-[TO] or bytes=-SUFFIX into [*from, *to] of size.  Returns 1
+ * for a range, 0 to send everything (no range or several of them) and -1
+ * for one that is not satisfiable.
+ */
+static int seed_range(const char *hdr, uint64_t size, uint64_t *from, uint64_t *to)
+{
+    unsigned long long a, b;
+    int n = 0;
+
+    if (!hdr || strncasecmp(hdr, "bytes=", 6))
+        return 0;
+    hdr += 6;
+    if (hdr[strcspn(hdr, ",\r")] == ',')
+        return 0;
+    if (sscanf(hdr, "-%llu%n", &b, &n) == 1 && n)
+    {
+        if (!b)
+            return -1;
+        *from = b < size ? size - b : 0;
+        *to = size - 1;
+        return 1;
+    }
+    n = sscanf(hdr, "%llu-%llu", &a, &b);
+    if (n < 1 || a >= size || (n == 2 && b < a))
+        return -1;
+    *from = a;
+    *to = n == 2 && b < size ? b : size - 1;
+    return 1;
+}
+
+/* One request; false to close the connection */
+static bool seed_answer(int fd, const char *req, uint64_t *served)
+{
+    struct seed_copy *c;
+    char method[8], path[256], hdr[1024], *id;
+    uint64_t size, from, to, pos, end;
+    bool head_only, keep;
+    int range, n;
+
+    if (sscanf(req, "%7s %255s HTTP/1.%d", method, path, &n) != 3)
+    {
+        seed_error(fd, "400 Bad Request");
+        return false;
+    }
+    keep = n >= 1;
+    if (seed_header(req, "Connection") && !strncasecmp(seed_header(req, "Connection"), "close", 5))
+        keep = false;
+    head_only = !strcmp(method, "HEAD");
+    if (!head_only && strcmp(method, "GET"))
+        return seed_error(fd, "405 Method Not Allowed") && keep;
+    if (strcmp(path, "/") && strcmp(path, "/scratchpad.bin"))
+        return seed_error(fd, "404 Not Found") && keep;
+    c = seed_get();
+    if (!c)
+        return seed_error(fd, "503 Service Unavailable") && keep;
+
+    size = SCRATCHPAD_FILE_DATA_OFFSET + c->bytes;
+    from = 0;
+    to = size - 1;
+    range = seed_range(seed_header(req, "Range"), size, &from, &to);
+    id = bin2hex(c->hi.prevhash, sizeof(c->hi.prevhash));
+    if (range < 0)
+    {
+        snprintf(hdr, sizeof(hdr), "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%" PRIu64
+                 "\r\nContent-Length: 0\r\n\r\n", size);
+        keep = seed_send(fd, hdr, strlen(hdr)) && keep;
+        goto out;
+    }
+    snprintf(hdr, sizeof(hdr),
+             "HTTP/1.1 %s\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Length: %" PRIu64 "\r\n"
+             "Accept-Ranges: bytes\r\n"
+             "ETag: \"%" PRIu64 "-%.16s\"\r\n"
+             "X-Scratchpad-Height: %" PRIu64 "\r\n"
+             "X-Scratchpad-Block-Id: %s\r\n",
+             range ? "206 Partial Content" : "200 OK", to - from + 1,
+             c->hi.height, id, c->hi.height, id);
+    if (range)
+        snprintf(hdr + strlen(hdr), sizeof(hdr) - strlen(hdr),
+                 "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu64 "\r\n", from, to, size);
+    snprintf(hdr + strlen(hdr), sizeof(hdr) - strlen(hdr), "Connection: %s\r\n\r\n",
+             keep ? "keep-alive" : "close");
+    if (!seed_send(fd, hdr, strlen(hdr)))
+    {
+        keep = false;
+        goto out;
+    }
+    if (head_only)
+        goto out;
+    for (pos = from, end = to + 1; pos < end && keep; )
+    {
+        /* the header area, then the data */
+        uint64_t lim = pos < SCRATCHPAD_FILE_DATA_OFFSET ? SCRATCHPAD_FILE_DATA_OFFSET : end;
+        const uint8_t *p = pos < SCRATCHPAD_FILE_DATA_OFFSET ? c->head + pos :
+                           c->data + (pos - SCRATCHPAD_FILE_DATA_OFFSET);
+
+        if (lim > end)
+            lim = end;
+        if (!seed_send(fd, p, lim - pos))
+            keep = false;
+        *served += lim - pos;
+        pos = lim;
+    }
+out:
+    free(id);
+    pthread_mutex_lock(&seed_lock);
+    seed_put(c);
+    pthread_mutex_unlock(&seed_lock);
+    return keep;
+}
+
+struct seed_peer {
+    int fd;
+    char name[64];
+};
+
+static void *seed_peer_thread(void *userdata)
+{
+    struct seed_peer *peer = userdata;
+    char req[SEED_REQUEST_MAX + 1];
+    size_t have = 0;
+    uint64_t served = 0;
+    long long start = seed_ms();
+    char *end;
+    ssize_t n;
+
+    for (;;)
+    {
+        req[have] = 0;
+        end = strstr(req, "\r\n\r\n");
+        if (end)
+        {
+            size_t len = end + 4 - req;
+
+            end[2] = 0;
+            if (!seed_answer(peer->fd, req, &served))
+                break;
+            memmove(req, req + len, have - len);
+            have -= len;
+            continue;
+        }
+        if (have == SEED_REQUEST_MAX)
+            break;
+        n = recv(peer->fd, req + have, SEED_REQUEST_MAX - have, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        have += n;
+    }
+    close(peer->fd);
+    if (served > SCRATCHPAD_FILE_DATA_OFFSET)
+    {
+        long long ms = seed_ms() - start;
+
+        applog(LOG_INFO, "Seeded %" PRIu64 " MB of scratchpad to %s in %lld ms, %.0f MB/s",
+               served >> 20, peer->name, ms, served / 1048576.0 / (ms * 1e-3 + 1e-9));
+    }
+    free(peer);
+    pthread_mutex_lock(&seed_lock);
+    seed_peers--;
+    pthread_mutex_unlock(&seed_lock);
+    return NULL;
+}
+
+static void *seed_thread(void *userdata)
+{
+    int lfd = (int)(intptr_t)userdata;
+
+    for (;;)
+    {
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        struct seed_peer *peer;
+        struct timeval tv = {SEED_TIMEOUT, 0};
+        pthread_attr_t attr;
+        pthread_t pth;
+        bool full;
+        int fd;
+
+        if (poll(&pfd, 1, 1000) <= 0)
+        {
+            /* a copy nobody asked for in a while goes back to the allocator */
+            pthread_mutex_lock(&seed_lock);
+            if (seed_cur && seed_cur->refs == 1 && seed_ms() - seed_last_ms > SEED_IDLE_MS)
+            {
+                seed_put(seed_cur);
+                seed_cur = NULL;
+            }
+            pthread_mutex_unlock(&seed_lock);
+            continue;
+        }
+        fd = accept4(lfd, (struct sockaddr *)&sa, &salen, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        pthread_mutex_lock(&seed_lock);
+        full = seed_peers >= SEED_MAX_PEERS;
+        if (!full)
+            seed_peers++;
+        pthread_mutex_unlock(&seed_lock);
+        if (full)
+        {
+            seed_error(fd, "503 Service Unavailable");
+            close(fd);
+            continue;
+        }
+
+        peer = xcalloc(1, sizeof(*peer));
+        peer->fd = fd;
+        if (getnameinfo((struct sockaddr *)&sa, salen, peer->name, sizeof(peer->name), NULL, 0, NI_NUMERICHOST))
+            snprintf(peer->name, sizeof(peer->name), "a peer");
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&pth, &attr, seed_peer_thread, peer))
+        {
+            close(fd);
+            free(peer);
+            pthread_mutex_lock(&seed_lock);
+            seed_peers--;
+            pthread_mutex_unlock(&seed_lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return NULL;
+}
+
+/* Listens on [ADDR:]PORT, every address when ADDR is left out */
+bool seed_start(const char *arg)
+{
+    struct addrinfo hints = {0}, *ai;
+    char host[256], *node = NULL, *port;
+    pthread_t pth;
+    int fd, on = 1, err;
+
+    snprintf(host, sizeof(host), "%s", arg);
+    port = strrchr(host, ':');
+    if (port)
+    {
+        *port++ = 0;
+        if (host[0])
+            node = host;
+    }
+    else
+        port = host;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    err = getaddrinfo(node, port, &hints, &ai);
+    if (err)
+    {
+        applog(LOG_ERR, "--scratchpad-serve %s: %s", arg, gai_strerror(err));
+        return false;
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, SEED_MAX_PEERS))
+    {
+        applog(LOG_ERR, "failed to listen on %s for --scratchpad-serve: %s", port, strerror(errno));
+        freeaddrinfo(ai);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    freeaddrinfo(ai);
+    if (pthread_create(&pth, NULL, seed_thread, (void *)(intptr_t)fd))
+    {
+        applog(LOG_ERR, "seed thread create failed");
+        close(fd);
+        return false;
+    }
+    pthread_detach(pth);
+    applog(LOG_INFO, "Serving the scratchpad on port %s, -k http://<this host>:%s/scratchpad.bin", port, port);
+    return true;
+}
+
+#else
+
+bool seed_start(const char *arg)
+{
+    applog(LOG_ERR, "--scratchpad-serve is not supported on Windows");
+    return false;
+}
+
+#endif
@@ -0,0 +1,258 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// --scratchpad-shm: one scratchpad for every minerd on the host, kept in a
+// named file on tmpfs or hugetlbfs that each process maps as
+// pscratchpad_buff.  Whoever holds the flock on the file is the writer; it
+// loads, downloads and applies addenda as a lone miner would and publishes
+// the resulting scratchpad_file_header in the segment header under a
+// sequence count.  The others map the data read-only, take the header as
+// their state and try the lock again when the writer seems to be gone.
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#endif
+#include "miner.h"
+
+bool shm_writer = false;
+
+#if defined(__linux__)
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#define SHM_MAGIC "WKSHM001"
+
+struct shm_header {
+    char magic[8];
+    uint64_t data_offset;                /* one page of the file system */
+    uint32_t seq;                        /* odd while the writer changes the scratchpad */
+    uint32_t writer_pid;
+    struct scratchpad_file_header state; /* what the data holds while seq is even */
+};
+
+static char shm_path[PATH_MAX];
+static int shm_fd = -1;
+static size_t shm_unit;                  /* data offset and growth step */
+static size_t shm_bytes;                 /* data bytes the file holds */
+static struct shm_header *shm_hdr;
+static uint64_t *shm_data;
+
+static bool shm_size(void)
+{
+    struct stat st;
+
+    if (fstat(shm_fd, &st))
+    {
+        applog(LOG_ERR, "fstat error from %s: %s", shm_path, strerror(errno));
+        return false;
+    }
+    shm_bytes = (size_t)st.st_size > shm_unit ? (size_t)st.st_size - shm_unit : 0;
+    return true;
+}
+
+/*
+ * Opens or creates the segment and maps it.  NAME without a slash is
+ * created in /dev/shm, anything else is taken as a path, e.g. a file on a
+ * hugetlbfs mount.  Returns the data mapping, writable for the writer.
+ */
+uint64_t *shm_attach(const char *name)
+{
+    struct statfs sfs;
+    int prot;
+
+    if (strchr(name, '/'))
+        snprintf(shm_path, sizeof(shm_path), "%s", name);
+    else
+        snprintf(shm_path, sizeof(shm_path), "/dev/shm/%s", name);
+    shm_fd = open(shm_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (shm_fd < 0)
+    {
+        applog(LOG_ERR, "failed to open %s: %s", shm_path, strerror(errno));
+        return NULL;
+    }
+    shm_unit = 2 << 20;
+    if (!fstatfs(shm_fd, &sfs) && (size_t)sfs.f_bsize > shm_unit)
+        shm_unit = sfs.f_bsize;
+
+    /* a reader needs the header the first writer creates */
+    for (;;)
+    {
+        struct shm_header h;
+
+        shm_writer = !flock(shm_fd, LOCK_EX | LOCK_NB);
+        if (shm_writer)
+            break;
+        if (pread(shm_fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, SHM_MAGIC, 8))
+            break;
+        applog(LOG_INFO, "Waiting for the writer of %s", shm_path);
+        sleep(1);
+    }
+    if (!shm_size())
+        return NULL;
+    if (shm_writer && !shm_bytes && ftruncate(shm_fd, shm_unit))
+    {
+        applog(LOG_ERR, "failed to extend %s: %s", shm_path, strerror(errno));
+        return NULL;
+    }
+
+    prot = PROT_READ | (shm_writer ? PROT_WRITE : 0);
+    shm_hdr = mmap(NULL, shm_unit, prot, MAP_SHARED, shm_fd, 0);
+    if (shm_hdr == MAP_FAILED)
+    {
+        applog(LOG_ERR, "failed to map %s: %s", shm_path, strerror(errno));
+        return NULL;
+    }
+    if (shm_writer && (memcmp(shm_hdr->magic, SHM_MAGIC, 8) || shm_hdr->data_offset != shm_unit))
+    {
+        memset(shm_hdr, 0, sizeof(*shm_hdr));
+        shm_hdr->data_offset = shm_unit;
+        memcpy(shm_hdr->magic, SHM_MAGIC, 8);
+    }
+    if (memcmp(shm_hdr->magic, SHM_MAGIC, 8) || shm_hdr->data_offset != shm_unit)
+    {
+        applog(LOG_ERR, "%s is not a scratchpad segment", shm_path);
+        return NULL;
+    }
+    /* the file grows under the mapping, as the reserved buffer is committed */
+    shm_data = mmap(NULL, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, prot, MAP_SHARED | MAP_NORESERVE,
+                    shm_fd, shm_unit);
+    if (shm_data == MAP_FAILED)
+    {
+        applog(LOG_ERR, "failed to map %zu MB of %s: %s", WILD_KECCAK_SCRATCHPAD_BUFFSIZE >> 20,
+               shm_path, strerror(errno));
+        return NULL;
+    }
+    applog(LOG_INFO, "Scratchpad segment %s: %zu MB, %s", shm_path, shm_bytes >> 20,
+           shm_writer ? "applying addenda for the host" : "following the writer read-only");
+    return shm_data;
+}
+
+/* Copies the published state; false while it is being changed or empty */
+bool shm_read(struct scratchpad_file_header *fh)
+{
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&shm_hdr->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            return false;
+        memcpy(fh, &shm_hdr->state, sizeof(*fh));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&shm_hdr->seq, __ATOMIC_RELAXED) != seq);
+    return fh->scratchpad_size != 0;
+}
+
+/* Writer: readers stop taking the state until the next shm_publish */
+void shm_begin(void)
+{
+    uint32_t seq;
+
+    if (!shm_writer)
+        return;
+    seq = shm_hdr->seq;
+    if (!(seq & 1))
+        __atomic_store_n(&shm_hdr->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shm_publish(const struct scratchpad_file_header *fh)
+{
+    if (!shm_writer)
+        return;
+    shm_begin();
+    memcpy(&shm_hdr->state, fh, sizeof(*fh));
+    shm_hdr->writer_pid = getpid();
+    __atomic_store_n(&shm_hdr->seq, shm_hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reader: takes over as writer if nobody holds the lock any more.  A
+ * writer that died between shm_begin and shm_publish leaves the count odd,
+ * shm_read keeps failing and the new writer has to rebuild the data.
+ */
+bool shm_try_promote(void)
+{
+    if (shm_writer)
+        return true;
+    if (flock(shm_fd, LOCK_EX | LOCK_NB))
+        return false;
+    if (mprotect(shm_hdr, shm_unit, PROT_READ | PROT_WRITE) ||
+        mprotect(shm_data, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, PROT_READ | PROT_WRITE))
+    {
+        applog(LOG_ERR, "failed to remap %s writable: %s", shm_path, strerror(errno));
+        flock(shm_fd, LOCK_UN);
+        return false;
+    }
+    shm_writer = true;
+    applog(LOG_NOTICE, "Writer %u of %s is gone, applying addenda from now on",
+           shm_hdr->writer_pid, shm_path);
+    return shm_size();
+}
+
+/* Writer: grows the segment to hold the first bytes of data */
+bool shm_commit(size_t bytes)
+{
+    if (bytes <= shm_bytes)
+        return true;
+    if (!shm_writer || bytes > WILD_KECCAK_SCRATCHPAD_BUFFSIZE)
+        return false;
+    bytes = (bytes + shm_unit - 1) / shm_unit * shm_unit;
+    if (ftruncate(shm_fd, shm_unit + bytes))
+    {
+        applog(LOG_ERR, "failed to extend %s to %zu MB: %s", shm_path, bytes >> 20, strerror(errno));
+        return false;
+    }
+    shm_bytes = bytes;
+    return true;
+}
+
+#else /* !__linux__ */
+
+uint64_t *shm_attach(const char *name)
+{
+    applog(LOG_ERR, "--scratchpad-shm is only supported on Linux");
+    return NULL;
+}
+
+bool shm_read(struct scratchpad_file_header *fh)
+{
+    return false;
+}
+
+void shm_begin(void)
+{
+}
+
+void shm_publish(const struct scratchpad_file_header *fh)
+{
+}
+
+bool shm_try_promote(void)
+{
+    return false;
+}
+
+bool shm_commit(size_t bytes)
+{
+    return false;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,256 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Scratchpad file I/O: the data part of a cache file read or written with
+// pread/pwrite on several threads, each taking whole 2 MB chunks so a
+// huge page is only ever touched by one of them.  For the cache file the
+// aligned bulk goes through O_DIRECT, which keeps a second copy of the
+// scratchpad out of the page cache; where the file system refuses it the
+// buffered path runs instead and drops what it cached afterwards.
+// Checksums of the chunks, when asked for, are taken by the same threads
+// while the data is still in their caches.
+
+#include "cpuminer-config.h"
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include "miner.h"
+#include "xmalloc.h"
+
+#if !defined(_WIN64) && !defined(_WIN32)
+
+#define SPIO_CHUNK    SCRATCHPAD_FILE_CHUNK /* threads split the data on huge page bounds */
+#define SPIO_ALIGN    4096      /* O_DIRECT offset, length and memory alignment */
+
+struct spio_thread {
+    pthread_t pth;
+    struct spio *io;
+    int idx;
+    int dfd;                    /* O_DIRECT descriptor, -1 once refused */
+    bool write;
+    int err;
+    long long sum_usec;
+};
+
+#define SUM_P1 0x9e3779b185ebca87ULL
+#define SUM_P2 0xc2b2ae3d27d4eb4fULL
+
+static inline uint64_t sum_round(uint64_t acc, uint64_t w)
+{
+    acc += w * SUM_P2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * SUM_P1;
+}
+
+/*
+ * Checksum of len bytes, a multiple of 8: four independent multiply-rotate
+ * lanes in the style of xxHash64, so it runs at memory speed instead of
+ * the byte at a time of the journal's FNV-1a.
+ */
+uint64_t spio_sum(const void *p, size_t len)
+{
+    const uint64_t *w = p;
+    size_t n = len / 8, i;
+    uint64_t a0 = SUM_P1 + SUM_P2, a1 = SUM_P2, a2 = 0, a3 = -SUM_P1, h;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        a0 = sum_round(a0, w[i]);
+        a1 = sum_round(a1, w[i + 1]);
+        a2 = sum_round(a2, w[i + 2]);
+        a3 = sum_round(a3, w[i + 3]);
+    }
+    h = ((a0 << 1) | (a0 >> 63)) + ((a1 << 7) | (a1 >> 57)) +
+        ((a2 << 12) | (a2 >> 52)) + ((a3 << 18) | (a3 >> 46));
+    for (; i < n; i++)
+        h = sum_round(h ^ w[i], SUM_P1);
+    h ^= len;
+    h ^= h >> 33;
+    h *= SUM_P2;
+    h ^= h >> 29;
+    return h;
+}
+
+/* Another descriptor for the file behind io->fd, opened for direct I/O */
+static int spio_open_direct(const struct spio *io, bool write)
+{
+#if defined(__linux__) && defined(O_DIRECT)
+    char path[64];
+
+    if (!io->uncached || (io->offset | (uintptr_t)io->buf) % SPIO_ALIGN)
+        return -1;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", io->fd);
+    return open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+#else
+    return -1;
+#endif
+}
+
+/* Moves [pos, end) of the data, the bulk through the O_DIRECT descriptor */
+static void spio_transfer(struct spio_thread *t, size_t pos, size_t end)
+{
+    struct spio *io = t->io;
+    size_t direct_end = io->bytes / SPIO_ALIGN * SPIO_ALIGN;
+    size_t len;
+    ssize_t r;
+    int fd;
+
+    while (pos < end)
+    {
+        /* the unaligned tail of the data always goes through the cache */
+        fd = t->dfd >= 0 && pos < direct_end && pos % SPIO_ALIGN == 0 ? t->dfd : io->fd;
+        len = end - pos;
+        if (fd == t->dfd && pos + len > direct_end)
+            len = direct_end - pos;
+        if (t->write)
+            r = pwrite(fd, io->buf + pos, len, io->offset + pos);
+        else
+            r = pread(fd, io->buf + pos, len, io->offset + pos);
+        if (r < 0 && fd == t->dfd && errno == EINVAL)
+        {
+            t->dfd = -1;
+            continue;
+        }
+        if (r == 0 && !t->write && io->sums)
+        {
+            /* a truncated file, the checksums tell the caller */
+            memset(io->buf + pos, 0, end - pos);
+            return;
+        }
+        if (r <= 0)
+        {
+            t->err = r ? errno : EIO;
+            return;
+        }
+        pos += r;
+    }
+}
+
+static void spio_chunk_sum(struct spio_thread *t, size_t c, size_t pos, size_t end)
+{
+    struct timeval tv_start, tv_end;
+
+    gettimeofday(&tv_start, NULL);
+    t->io->sums[c] = spio_sum(t->io->buf + pos, end - pos);
+    gettimeofday(&tv_end, NULL);
+    t->sum_usec += (tv_end.tv_sec - tv_start.tv_sec) * 1000000LL + tv_end.tv_usec - tv_start.tv_usec;
+}
+
+static void *spio_thread(void *userdata)
+{
+    struct spio_thread *t = userdata;
+    struct spio *io = t->io;
+    size_t chunks = (io->bytes + SPIO_CHUNK - 1) / SPIO_CHUNK;
+    size_t c = chunks * t->idx / io->threads;
+    size_t last = chunks * (t->idx + 1) / io->threads;
+    size_t pos, end;
+
+    if (io->thread_init)
+        io->thread_init(t->idx);
+    for (; c < last && !t->err; c++)
+    {
+        pos = c * SPIO_CHUNK;
+        end = pos + SPIO_CHUNK < io->bytes ? pos + SPIO_CHUNK : io->bytes;
+        if (t->write && io->sums)
+            spio_chunk_sum(t, c, pos, end);
+        spio_transfer(t, pos, end);
+        if (!t->write && io->sums && !t->err)
+            spio_chunk_sum(t, c, pos, end);
+    }
+    return NULL;
+}
+
+static bool spio_run(struct spio *io, bool write)
+{
+    struct spio_thread *t;
+    struct timeval tv_start, tv_end;
+    size_t chunks = (io->bytes + SPIO_CHUNK - 1) / SPIO_CHUNK;
+    int dfd, i, err = 0;
+
+    gettimeofday(&tv_start, NULL);
+    if (io->threads > (int)chunks)
+        io->threads = chunks;
+    if (io->threads < 1)
+        io->threads = 1;
+    dfd = spio_open_direct(io, write);
+    io->direct = dfd >= 0;
+    io->sum_usec = 0;
+
+    t = xcalloc(io->threads, sizeof(*t));
+    for (i = 0; i < io->threads; i++)
+    {
+        t[i].io = io;
+        t[i].idx = i;
+        t[i].dfd = dfd;
+        t[i].write = write;
+        if (pthread_create(&t[i].pth, NULL, spio_thread, &t[i]))
+        {
+            spio_thread(&t[i]);
+            t[i].io = NULL; /* nothing to join */
+        }
+    }
+    for (i = 0; i < io->threads; i++)
+    {
+        if (t[i].io)
+            pthread_join(t[i].pth, NULL);
+        if (t[i].dfd < 0)
+            io->direct = false;
+        io->sum_usec += t[i].sum_usec;
+        if (!err)
+            err = t[i].err;
+    }
+    free(t);
+    if (dfd >= 0)
+        close(dfd);
+
+#if defined(POSIX_FADV_DONTNEED)
+    /* starts writeback of what a buffered write left dirty, drops the rest */
+    if (io->uncached && !io->direct)
+        posix_fadvise(io->fd, io->offset, io->bytes, POSIX_FADV_DONTNEED);
+#endif
+    gettimeofday(&tv_end, NULL);
+    io->usec = (tv_end.tv_sec - tv_start.tv_sec) * 1000000LL + tv_end.tv_usec - tv_start.tv_usec;
+    if (err)
+    {
+        applog(LOG_ERR, "%s error on %s: %s", write ? "write" : "read", io->name, strerror(err));
+        return false;
+    }
+    return true;
+}
+
+bool spio_read(struct spio *io)
+{
+    return spio_run(io, false);
+}
+
+bool spio_write(struct spio *io)
+{
+    return spio_run(io, true);
+}
+
+/* One line with the size, time and throughput of a finished transfer */
+void spio_report(const char *what, const struct spio *io)
+{
+    char sums[64] = "";
+
+    /* per thread: how many of them run at once is up to the CPUs */
+    if (io->sums)
+        snprintf(sums, sizeof(sums), ", checksums at %.1f GB/s per thread",
+                 io->bytes / 1e9 / (io->sum_usec * 1e-6 + 1e-9));
+    applog(LOG_INFO, "%s %zu MB of scratchpad in %lld ms, %.0f MB/s (%d threads, %s I/O%s)",
+           what, io->bytes >> 20, io->usec / 1000,
+           io->bytes / 1048576.0 / (io->usec * 1e-6 + 1e-9), io->threads,
+           io->direct ? "direct" : "buffered", sums);
+}
+
+#endif
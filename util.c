@@ -448,69 +448,44 @@ err_out:
 
 char *bin2hex(const unsigned char *p, size_t len)
 {
-    int i;
     char *s = xmalloc((len * 2) + 1);
 
-    for (i = 0; i < len; i++)
-        sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
-
+    hex_encode(s, p, len);
+    s[len * 2] = '\0';
     return s;
 }
 
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
-    char hex_byte[3];
-    char *ep;
-
-    hex_byte[2] = '\0';
+    size_t n = strnlen(hexstr, len * 2 + 1);
 
-    while (*hexstr && len) {
-        if (!hexstr[1]) {
+    if (n != len * 2) {
+        if (n < len * 2 && n % 2)
             applog(LOG_ERR, "hex2bin str truncated");
-            return false;
-        }
-        hex_byte[0] = hexstr[0];
-        hex_byte[1] = hexstr[1];
-        *p = (unsigned char) strtol(hex_byte, &ep, 16);
-        if (*ep) {
-            applog(LOG_ERR, "hex2bin failed on '%s'", hex_byte);
-            return false;
-        }
-        p++;
-        hexstr += 2;
-        len--;
+        return false;
     }
-
-    return (len == 0 && *hexstr == 0) ? true : false;
+    if (!hex_decode(p, hexstr, len)) {
+        applog(LOG_ERR, "hex2bin failed on invalid hex digits");
+        return false;
+    }
+    return true;
 }
 
 size_t hex2bin_len(unsigned char *p, const char *hexstr, size_t len)
 {
-    char hex_byte[3];
-    char *ep;
-    size_t count = 0;
+    size_t n = strnlen(hexstr, len * 2 + 1);
 
-    hex_byte[2] = '\0';
-
-    while (*hexstr && len) {
-        if (!hexstr[1]) {
-            applog(LOG_ERR, "hex2bin str truncated");
-            return 0;
-        }
-        hex_byte[0] = hexstr[0];
-        hex_byte[1] = hexstr[1];
-        *p = (unsigned char) strtol(hex_byte, &ep, 16);
-        if (*ep) {
-            applog(LOG_ERR, "hex2bin failed on '%s'", hex_byte);
-            return 0;
-        }
-        count++;
-        p++;
-        hexstr += 2;
-        len--;
+    if (n > len * 2)
+        return 0;
+    if (n % 2) {
+        applog(LOG_ERR, "hex2bin str truncated");
+        return 0;
     }
-
-    return (/*len == 0 &&*/ *hexstr == 0) ? count : 0;
+    if (!hex_decode(p, hexstr, n / 2)) {
+        applog(LOG_ERR, "hex2bin failed on invalid hex digits");
+        return 0;
+    }
+    return n / 2;
 }
 
 /* Subtract the `struct timeval' values X and Y,
@@ -757,6 +732,193 @@ char *stratum_recv_line(struct stratum_ctx *sctx)
     return stratum_recv_line_timeout(sctx, 60);
 }
 
+/*
+ * The getfullscratchpad response is one line holding the whole scratchpad
+ * as a ~700 MB hex string.  Rather than buffering that line, its
+ * scratchpad_hex value is decoded straight into the destination as it
+ * arrives and the rest of the line, with the value left empty, is kept for
+ * the JSON parser.
+ */
+#define SP_RECVSIZE (1 << 20)
+
+struct sp_recv {
+    enum { SP_PREFIX, SP_HEX, SP_SUFFIX, SP_DONE } state;
+    char *line;                 /* the response without the hex value */
+    size_t line_len, line_size;
+    unsigned char *dst;
+    size_t len, max;            /* bytes decoded into dst, and room there */
+    int nibble;                 /* high half of a byte split across reads, or -1 */
+};
+
+static inline int hex_nibble(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static void sp_line_append(struct sp_recv *r, const char *p, size_t n)
+{
+    if (r->line_len + n + 1 > r->line_size) {
+        r->line_size = r->line_len + n + 1 + RBUFSIZE;
+        r->line = xrealloc(r->line, r->line_size, 1);
+    }
+    memcpy(r->line + r->line_len, p, n);
+    r->line_len += n;
+    r->line[r->line_len] = '\0';
+}
+
+/* Offset just past the opening quote of the scratchpad_hex value, or 0 */
+static size_t sp_find_value(const struct sp_recv *r)
+{
+    static const char key[] = "\"scratchpad_hex\"";
+    const char *p = strstr(r->line, key);
+
+    if (!p)
+        return 0;
+    for (p += sizeof(key) - 1; isspace((unsigned char)*p); p++);
+    if (*p++ != ':')
+        return 0;
+    for (; isspace((unsigned char)*p); p++);
+    if (*p != '"')
+        return 0;
+    return p + 1 - r->line;
+}
+
+/* Decodes hex up to the closing quote, which is left for the line */
+static ssize_t sp_decode(struct sp_recv *r, const char *p, size_t n)
+{
+    const char *q = memchr(p, '"', n);
+    size_t avail = q ? q - p : n, used = 0, pairs;
+    int v;
+
+    /* the buffer is backed as the scratchpad arrives; +1 for a split pair */
+    if (r->len + avail / 2 + 1 <= r->max && !scratchpad_commit(r->len + avail / 2 + 1))
+        goto bad;
+    if (r->nibble >= 0 && avail) {
+        v = hex_nibble(p[0]);
+        if (v < 0 || r->len == r->max)
+            goto bad;
+        r->dst[r->len++] = (r->nibble << 4) | v;
+        r->nibble = -1;
+        used = 1;
+    }
+    pairs = (avail - used) / 2;
+    if (pairs > r->max - r->len)
+        goto bad;
+    if (!hex_decode(r->dst + r->len, p + used, pairs))
+        goto bad;
+    r->len += pairs;
+    used += pairs * 2;
+    if (used < avail) {
+        if ((r->nibble = hex_nibble(p[used])) < 0)
+            goto bad;
+        used++;
+    }
+    if (q) {
+        if (r->nibble >= 0)
+            goto bad;
+        r->state = SP_SUFFIX;
+    }
+    return used;
+
+bad:
+    applog(LOG_ERR, "getfullscratchpad: scratchpad_hex is not valid hex or exceeds %zu bytes", r->max);
+    return -1;
+}
+
+/* Runs n received bytes at p, NUL-terminated, through the response parser */
+static bool sp_feed(struct stratum_ctx *sctx, struct sp_recv *r, char *p, size_t n)
+{
+    while (n && r->state != SP_DONE) {
+        if (r->state == SP_HEX) {
+            ssize_t used = sp_decode(r, p, n);
+
+            if (used < 0)
+                return false;
+            p += used;
+            n -= used;
+            continue;
+        }
+
+        char *nl = memchr(p, '\n', n);
+        size_t take = nl ? nl - p : n, q;
+
+        sp_line_append(r, p, take);
+        p += take;
+        n -= take;
+        if (r->state == SP_PREFIX && (q = sp_find_value(r))) {
+            /* the opening quote came in this read, so whatever follows it is still at p */
+            size_t extra = r->line_len - q;
+
+            r->line_len = q;
+            r->line[q] = '\0';
+            p -= extra;
+            n += extra;
+            r->state = SP_HEX;
+            continue;
+        }
+        if (nl) {
+            r->state = SP_DONE;
+            p++;
+            n--;
+        }
+    }
+    /* the start of whatever the pool sent next */
+    if (n)
+        stratum_buffer_append(sctx, p);
+    return true;
+}
+
+static char *stratum_recv_scratchpad(struct stratum_ctx *sctx, int timeout_, unsigned char *dst, size_t max, size_t *len)
+{
+    struct sp_recv r = { SP_PREFIX };
+    char *buf = xmalloc(SP_RECVSIZE + 1);
+    char *pending = xstrdup(sctx->sockbuf);
+    time_t rstart;
+    ssize_t n;
+
+    r.dst = dst;
+    r.max = max;
+    r.nibble = -1;
+    sctx->sockbuf[0] = '\0';
+    if (!sp_feed(sctx, &r, pending, strlen(pending)))
+        goto out;
+
+    time(&rstart);
+    while (r.state != SP_DONE) {
+        if (time(NULL) - rstart >= timeout_ || !socket_full(sctx->sock, timeout_)) {
+            applog(LOG_ERR, "stratum_recv_line timed out");
+            goto out;
+        }
+        n = recv(sctx->sock, buf, SP_RECVSIZE, 0);
+        if (!n || (n < 0 && !socket_blocks())) {
+            applog(LOG_ERR, "stratum_recv_line failed");
+            goto out;
+        }
+        if (n < 0)
+            continue;
+        buf[n] = '\0';
+        if (!sp_feed(sctx, &r, buf, n))
+            goto out;
+    }
+
+out:
+    free(pending);
+    free(buf);
+    if (r.state != SP_DONE) {
+        free(r.line);
+        return NULL;
+    }
+    if (opt_protocol)
+        applog(LOG_DEBUG, "< %s (%zu bytes of scratchpad_hex)", r.line, r.len * 2);
+    *len = r.len;
+    return r.line;
+}
+
 
 #if LIBCURL_VERSION_NUM >= 0x071101
 static curl_socket_t opensocket_grab_cb(void *clientp, curlsocktype purpose,
@@ -975,6 +1137,8 @@ bool stratum_getscratchpad(struct stratum_ctx *sctx) {
     json_t *val = NULL, *res_val, *err_val;
     char *s, *sret;
     json_error_t err;
+    struct timeval tv_start, tv_end, diff;
+    size_t len = 0;
     bool ret = false;
 
     xasprintf(&s, "{\"method\": \"getfullscratchpad\", \"params\": {\"id\": \"%s\", \"agent\": \"%s\"}, \"id\": 1}",
@@ -983,10 +1147,15 @@ bool stratum_getscratchpad(struct stratum_ctx *sctx) {
     if (!stratum_send_line(sctx, s))
         goto out;
 
-    sret = stratum_recv_line_timeout(sctx, 920);
+    gettimeofday(&tv_start, NULL);
+    scratchpad_begin_update(); //committed by the store_scratchpad_to_file that follows
+    sret = stratum_recv_scratchpad(sctx, 920, (unsigned char*)pscratchpad_buff, WILD_KECCAK_SCRATCHPAD_BUFFSIZE, &len);
     if (!sret)
         goto out;
-    applog(LOG_DEBUG, "Getting full scratchpad received line");
+    gettimeofday(&tv_end, NULL);
+    timeval_subtract(&diff, &tv_end, &tv_start);
+    applog(LOG_INFO, "Received scratchpad: %zu MB in %.1f s, %.1f MB/s", len >> 20,
+           diff.tv_sec + 1e-6 * diff.tv_usec, len / 1048576.0 / (diff.tv_sec + 1e-6 * diff.tv_usec + 1e-9));
 
     val = JSON_LOADS(sret, &err);
     free(sret);
@@ -997,7 +1166,7 @@ bool stratum_getscratchpad(struct stratum_ctx *sctx) {
 
     applog(LOG_DEBUG, "Getting full scratchpad parsed line");
 
-    ret = rpc2_getfullscratchpad_decode(val);  
+    ret = rpc2_getfullscratchpad_decode(val, len);
 
 out:
     free(s);
@@ -1477,3 +1646,40 @@ out:
     pthread_mutex_unlock(&tq->mutex);
     return rval;
 }
+
+/*
+ * Records a share of ring->job; false if the drainer is RESULT_RING_SIZE
+ * shares behind.  Only the miner thread owning the ring pushes.
+ */
+bool result_ring_push(struct result_ring *ring, uint64_t nonce, const uint32_t *hash)
+{
+    const unsigned head = ring->head;
+    struct scan_result *res;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RESULT_RING_SIZE)
+        return false;
+
+    res = &ring->slot[head % RESULT_RING_SIZE];
+    res->job = ring->job;
+    __atomic_add_fetch(&ring->job->refs, 1, __ATOMIC_RELAXED);
+    res->nonce = nonce;
+    memcpy(res->hash, hash, sizeof(res->hash));
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (ring->notify)
+        ring->notify(ring);
+    return true;
+}
+
+/* Takes the oldest share, whose job reference passes to the caller */
+bool result_ring_pop(struct result_ring *ring, struct scan_result *res)
+{
+    const unsigned tail = ring->tail;
+
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        return false;
+
+    *res = ring->slot[tail % RESULT_RING_SIZE];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,161 @@
+// Copyright (c) 2014 The Boolberry developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// AVX2 (4 lanes) and AVX-512 (8 lanes) WildKeccak kernels.  They are built
+// with per-function target attributes so that one binary carries all of
+// them; wildkeccak.c picks one at startup from what the CPU reports.
+
+#include <string.h>
+
+#include "miner.h"
+#include "reciprocal_div64.h"
+#include "wildkeccak.h"
+
+#if defined(__x86_64__) && defined(USE_AVX2)
+
+/* 4x4 transpose of 64-bit words: in[l] holds words 0..3 of lane l */
+static __attribute__((target("avx2"))) __always_inline void transpose4x4_epi64(__m256i out[4], const __m256i in[4])
+{
+    __m256i t0 = _mm256_unpacklo_epi64(in[0], in[1]);
+    __m256i t1 = _mm256_unpackhi_epi64(in[0], in[1]);
+    __m256i t2 = _mm256_unpacklo_epi64(in[2], in[3]);
+    __m256i t3 = _mm256_unpackhi_epi64(in[2], in[3]);
+
+    out[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+    out[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+    out[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+    out[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+/* XOR of the four 32-byte scratchpad lines a lane mixes into one word group */
+static __attribute__((target("avx2"))) __always_inline __m256i mix_lines(const uint64_t *pscr, const uint64_t *idx)
+{
+    __m256i m;
+
+    m = _mm256_loadu_si256((const __m256i *)&pscr[idx[0]]);
+    m = _mm256_xor_si256(m, _mm256_loadu_si256((const __m256i *)&pscr[idx[1]]));
+    m = _mm256_xor_si256(m, _mm256_loadu_si256((const __m256i *)&pscr[idx[2]]));
+    m = _mm256_xor_si256(m, _mm256_loadu_si256((const __m256i *)&pscr[idx[3]]));
+    return m;
+}
+
+static __attribute__((target("avx2"))) __always_inline __m256i mul64_avx2(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+static __attribute__((target("avx2"))) __always_inline void mix_group_avx2(__m256i *s, const uint64_t *pscr,
+                                                                            const uint64_t (*idx)[KK_MIXIN_SIZE], unsigned g)
+{
+    __m256i m[4], w[4];
+    unsigned l;
+
+    for (l = 0; l < 4; l++)
+        m[l] = mix_lines(pscr, &idx[l][g * 4]);
+    transpose4x4_epi64(w, m);
+    for (l = 0; l < 4; l++)
+        s[g * 4 + l] = _mm256_xor_si256(s[g * 4 + l], w[l]);
+}
+
+#define WK_V            __m256i
+#define WK_LANES        4
+#define WK_FN(name)     name##_avx2
+#define WK_TARGET       __attribute__((target("avx2")))
+#define WK_XOR(a, b)    _mm256_xor_si256(a, b)
+#define WK_MUL(a, b)    mul64_avx2(a, b)
+#define WK_ROTL(a, n)   _mm256_or_si256(_mm256_slli_epi64(a, n), _mm256_srli_epi64(a, 64 - (n)))
+#define WK_BSEL(a, b, c) _mm256_xor_si256(a, _mm256_and_si256(c, _mm256_xor_si256(b, a)))
+#define WK_SET1(x)      _mm256_set1_epi64x(x)
+#define WK_ZERO()       _mm256_setzero_si256()
+#define WK_ADD(a, b)    _mm256_add_epi64(a, b)
+#define WK_SUB(a, b)    _mm256_sub_epi64(a, b)
+#define WK_AND(a, b)    _mm256_and_si256(a, b)
+#define WK_SLLI(a, n)   _mm256_slli_epi64(a, n)
+#define WK_SRLI(a, n)   _mm256_srli_epi64(a, n)
+#define WK_SRL(a, cnt)  _mm256_srl_epi64(a, cnt)
+#define WK_MULU32(a, b) _mm256_mul_epu32(a, b)
+/* signed compare is fine, the remainder is below 2 * lines */
+#define WK_CSUB(a, max, b) _mm256_sub_epi64(a, _mm256_and_si256(_mm256_cmpgt_epi64(a, max), b))
+#include "wildkeccak-simd.h"
+#undef WK_V
+#undef WK_LANES
+#undef WK_FN
+#undef WK_TARGET
+#undef WK_XOR
+#undef WK_MUL
+#undef WK_ROTL
+#undef WK_BSEL
+#undef WK_SET1
+#undef WK_ZERO
+#undef WK_ADD
+#undef WK_SUB
+#undef WK_AND
+#undef WK_SLLI
+#undef WK_SRLI
+#undef WK_SRL
+#undef WK_MULU32
+#undef WK_CSUB
+
+#endif /* __x86_64__ && USE_AVX2 */
+
+#if defined(__x86_64__) && defined(USE_AVX512)
+
+static __attribute__((target("avx512f,avx512dq"))) __always_inline void mix_group_avx512(__m512i *s, const uint64_t *pscr,
+                                                                                         const uint64_t (*idx)[KK_MIXIN_SIZE], unsigned g)
+{
+    __m256i m[8], lo[4], hi[4];
+    unsigned l;
+
+    for (l = 0; l < 8; l++)
+        m[l] = mix_lines(pscr, &idx[l][g * 4]);
+    transpose4x4_epi64(lo, &m[0]);
+    transpose4x4_epi64(hi, &m[4]);
+    for (l = 0; l < 4; l++)
+        s[g * 4 + l] = _mm512_xor_si512(s[g * 4 + l],
+                                        _mm512_inserti64x4(_mm512_castsi256_si512(lo[l]), hi[l], 1));
+}
+
+#define WK_V            __m512i
+#define WK_LANES        8
+#define WK_FN(name)     name##_avx512
+#define WK_TARGET       __attribute__((target("avx512f,avx512dq")))
+#define WK_XOR(a, b)    _mm512_xor_si512(a, b)
+#define WK_MUL(a, b)    _mm512_mullo_epi64(a, b)
+#define WK_ROTL(a, n)   _mm512_rol_epi64(a, n)
+#define WK_BSEL(a, b, c) _mm512_ternarylogic_epi64(a, b, c, 0xd8) /* c ? b : a */
+#define WK_SET1(x)      _mm512_set1_epi64(x)
+#define WK_ZERO()       _mm512_setzero_si512()
+#define WK_ADD(a, b)    _mm512_add_epi64(a, b)
+#define WK_SUB(a, b)    _mm512_sub_epi64(a, b)
+#define WK_AND(a, b)    _mm512_and_si512(a, b)
+#define WK_SLLI(a, n)   _mm512_slli_epi64(a, n)
+#define WK_SRLI(a, n)   _mm512_srli_epi64(a, n)
+#define WK_SRL(a, cnt)  _mm512_srl_epi64(a, cnt)
+#define WK_MULU32(a, b) _mm512_mul_epu32(a, b)
+#define WK_CSUB(a, max, b) _mm512_mask_sub_epi64(a, _mm512_cmpgt_epu64_mask(a, max), a, b)
+#include "wildkeccak-simd.h"
+#undef WK_V
+#undef WK_LANES
+#undef WK_FN
+#undef WK_TARGET
+#undef WK_XOR
+#undef WK_MUL
+#undef WK_ROTL
+#undef WK_BSEL
+#undef WK_SET1
+#undef WK_ZERO
+#undef WK_ADD
+#undef WK_SUB
+#undef WK_AND
+#undef WK_SLLI
+#undef WK_SRLI
+#undef WK_SRL
+#undef WK_MULU32
+#undef WK_CSUB
+
+#endif /* __x86_64__ && USE_AVX512 */
@@ -0,0 +1,320 @@
+/*
+ * WildKeccak kernel body, included by wildkeccak-simd.c once per vector
+ * width.  The state is kept lane-interleaved: st[w] holds word w of every
+ * lane, so each keccakf_mul step is one vector operation for all lanes.
+ *
+ * The includer defines:
+ *   WK_V, WK_LANES      vector type and the number of 64-bit lanes in it
+ *   WK_FN(name)         name mangling for this width
+ *   WK_TARGET           target attribute enabling the ISA
+ *   WK_XOR, WK_MUL, WK_ROTL, WK_BSEL, WK_SET1, WK_ZERO
+ *   WK_ADD, WK_SUB, WK_AND, WK_SLLI, WK_SRLI
+ *   WK_SRL(a, cnt)      shift right by the count in the __m128i cnt
+ *   WK_MULU32(a, b)     product of the low 32 bits of a and b
+ *   WK_CSUB(a, max, b)  a > max ? a - b : a
+ *   WK_FN(mix_group)    XORs scratchpad lines into words 4g..4g+3
+ */
+
+/* reciprocal_value64 of the line count, broadcast for WK_FN(line_index) */
+struct WK_FN(recip) {
+    WK_V m_lo, m_hi, b, b_max;
+    __m128i sh1, sh2;
+};
+
+static WK_TARGET __always_inline void WK_FN(recip_init)(struct WK_FN(recip) *rc, uint64_t lines,
+                                                        struct reciprocal_value64 R)
+{
+    rc->m_lo = WK_SET1(R.m);
+    rc->m_hi = WK_SET1(R.m >> 32);
+    rc->b = WK_SET1(lines);
+    rc->b_max = WK_SET1(lines - 1);
+    rc->sh1 = _mm_cvtsi32_si128(R.sh1);
+    rc->sh2 = _mm_cvtsi32_si128(R.sh2);
+}
+
+/*
+ * reciprocal_remainder64(a, lines, R) << 2 in every lane.  Neither ISA has
+ * a 64x64->128 multiply, so the high half of a * R.m is put together from
+ * four 32x32 products; lines < 2^32 lets q * lines get away with two.
+ */
+static WK_TARGET __always_inline WK_V WK_FN(line_index)(WK_V a, const struct WK_FN(recip) *rc)
+{
+    const WK_V lo32 = WK_SET1(0xffffffffULL);
+    const WK_V a_hi = WK_SRLI(a, 32);
+    const WK_V p00 = WK_MULU32(a, rc->m_lo), p01 = WK_MULU32(a, rc->m_hi);
+    const WK_V p10 = WK_MULU32(a_hi, rc->m_lo), p11 = WK_MULU32(a_hi, rc->m_hi);
+    const WK_V mid = WK_ADD(WK_ADD(WK_SRLI(p00, 32), WK_AND(p01, lo32)), WK_AND(p10, lo32));
+    const WK_V t = WK_ADD(WK_ADD(p11, WK_SRLI(p01, 32)), WK_ADD(WK_SRLI(p10, 32), WK_SRLI(mid, 32)));
+    const WK_V q = WK_SRL(WK_ADD(t, WK_SRL(WK_SUB(a, t), rc->sh1)), rc->sh2);
+    const WK_V qb = WK_ADD(WK_MULU32(q, rc->b), WK_SLLI(WK_MULU32(WK_SRLI(q, 32), rc->b), 32));
+
+    return WK_SLLI(WK_CSUB(WK_SUB(a, qb), rc->b_max, rc->b), 2);
+}
+
+WK_TARGET void WK_FN(wild_keccak_line_indices)(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines)
+{
+    const struct reciprocal_value64 R = reciprocal_value64(lines);
+    struct WK_FN(recip) rc;
+    WK_V v;
+    size_t i;
+
+    WK_FN(recip_init)(&rc, lines, R);
+    for (i = 0; i + WK_LANES <= n; i += WK_LANES) {
+        memcpy(&v, w + i, sizeof(v));
+        v = WK_FN(line_index)(v, &rc);
+        memcpy(idx + i, &v, sizeof(v));
+    }
+    for (; i < n; i++)
+        idx[i] = reciprocal_remainder64(w[i], lines, R) << 2;
+}
+
+/* chi and iota, the steps every keccakf_mul ends with */
+static WK_TARGET __always_inline void WK_FN(chi_iota)(WK_V *s)
+{
+    WK_V tmp1, tmp2;
+    int i;
+
+    for (i = 0; i < 25; i += 5) {
+        tmp1 = s[i + 0]; tmp2 = s[i + 1];
+        s[i + 0] = WK_BSEL(WK_XOR(s[i + 0], s[i + 2]), s[i + 0], s[i + 1]);
+        s[i + 1] = WK_BSEL(WK_XOR(s[i + 1], s[i + 3]), s[i + 1], s[i + 2]);
+        s[i + 2] = WK_BSEL(WK_XOR(s[i + 2], s[i + 4]), s[i + 2], s[i + 3]);
+        s[i + 3] = WK_BSEL(WK_XOR(s[i + 3], tmp1), s[i + 3], s[i + 4]);
+        s[i + 4] = WK_BSEL(WK_XOR(s[i + 4], tmp2), s[i + 4], tmp1);
+    }
+    s[0] = WK_XOR(s[0], WK_SET1(0x0000000000000001ULL));
+}
+
+static WK_TARGET __always_inline void WK_FN(keccakf_mul)(WK_V *s)
+{
+    WK_V bc[5], t[5];
+    WK_V tmp1;
+    int i;
+
+    for (i = 0; i < 5; i++)
+        t[i] = WK_XOR(WK_XOR(s[i + 0], s[i + 5]), WK_MUL(WK_MUL(s[i + 10], s[i + 15]), s[i + 20]));
+
+    bc[0] = WK_XOR(t[0], WK_ROTL(t[2], 1));
+    bc[1] = WK_XOR(t[1], WK_ROTL(t[3], 1));
+    bc[2] = WK_XOR(t[2], WK_ROTL(t[4], 1));
+    bc[3] = WK_XOR(t[3], WK_ROTL(t[0], 1));
+    bc[4] = WK_XOR(t[4], WK_ROTL(t[1], 1));
+
+    tmp1 = WK_XOR(s[1], bc[0]);
+
+    s[0] = WK_XOR(s[0], bc[4]);
+    s[1] = WK_ROTL(WK_XOR(s[6], bc[0]), 44);
+    s[6] = WK_ROTL(WK_XOR(s[9], bc[3]), 20);
+    s[9] = WK_ROTL(WK_XOR(s[22], bc[1]), 61);
+    s[22] = WK_ROTL(WK_XOR(s[14], bc[3]), 39);
+    s[14] = WK_ROTL(WK_XOR(s[20], bc[4]), 18);
+    s[20] = WK_ROTL(WK_XOR(s[2], bc[1]), 62);
+    s[2] = WK_ROTL(WK_XOR(s[12], bc[1]), 43);
+    s[12] = WK_ROTL(WK_XOR(s[13], bc[2]), 25);
+    s[13] = WK_ROTL(WK_XOR(s[19], bc[3]), 8);
+    s[19] = WK_ROTL(WK_XOR(s[23], bc[2]), 56);
+    s[23] = WK_ROTL(WK_XOR(s[15], bc[4]), 41);
+    s[15] = WK_ROTL(WK_XOR(s[4], bc[3]), 27);
+    s[4] = WK_ROTL(WK_XOR(s[24], bc[3]), 14);
+    s[24] = WK_ROTL(WK_XOR(s[21], bc[0]), 2);
+    s[21] = WK_ROTL(WK_XOR(s[8], bc[2]), 55);
+    s[8] = WK_ROTL(WK_XOR(s[16], bc[0]), 45);
+    s[16] = WK_ROTL(WK_XOR(s[5], bc[4]), 36);
+    s[5] = WK_ROTL(WK_XOR(s[3], bc[2]), 28);
+    s[3] = WK_ROTL(WK_XOR(s[18], bc[2]), 21);
+    s[18] = WK_ROTL(WK_XOR(s[17], bc[1]), 15);
+    s[17] = WK_ROTL(WK_XOR(s[11], bc[0]), 10);
+    s[11] = WK_ROTL(WK_XOR(s[7], bc[1]), 6);
+    s[7] = WK_ROTL(WK_XOR(s[10], bc[4]), 3);
+    s[10] = WK_ROTL(tmp1, 1);
+
+    WK_FN(chi_iota)(s);
+}
+
+/* The first keccakf_mul of a single-block blob for nonces nonce .. nonce + WK_LANES - 1 */
+static WK_TARGET __always_inline void WK_FN(keccakf_mul_mid)(WK_V *s, const struct wk_midstate *mid, uint32_t nonce)
+{
+    const uint64_t *a = mid->s;
+    uint64_t w[WK_LANES];
+    WK_V s0, t0, bc0, bc3;
+    unsigned i;
+
+    for (i = 0; i < WK_LANES; i++)
+        w[i] = mid->w0 ^ ((uint64_t)(uint32_t)(nonce + i) << 8);
+    memcpy(&s0, w, sizeof(s0));
+    t0 = WK_XOR(s0, WK_SET1(mid->c0));
+    bc0 = WK_XOR(t0, WK_SET1(mid->r2));
+    bc3 = WK_XOR(WK_SET1(mid->t3), WK_ROTL(t0, 1));
+
+    for (i = 0; i < 25; i++)
+        s[i] = WK_SET1(mid->b[i]);
+    s[0] = WK_XOR(s0, WK_SET1(mid->bc4));
+    s[1] = WK_ROTL(WK_XOR(WK_SET1(a[6]), bc0), 44);
+    s[6] = WK_ROTL(WK_XOR(WK_SET1(a[9]), bc3), 20);
+    s[22] = WK_ROTL(WK_XOR(WK_SET1(a[14]), bc3), 39);
+    s[13] = WK_ROTL(WK_XOR(WK_SET1(a[19]), bc3), 8);
+    s[15] = WK_ROTL(WK_XOR(WK_SET1(a[4]), bc3), 27);
+    s[4] = WK_ROTL(WK_XOR(WK_SET1(a[24]), bc3), 14);
+    s[24] = WK_ROTL(WK_XOR(WK_SET1(a[21]), bc0), 2);
+    s[8] = WK_ROTL(WK_XOR(WK_SET1(a[16]), bc0), 45);
+    s[17] = WK_ROTL(WK_XOR(WK_SET1(a[11]), bc0), 10);
+    s[10] = WK_ROTL(WK_XOR(WK_SET1(a[1]), bc0), 1);
+
+    WK_FN(chi_iota)(s);
+}
+
+/* The first keccakf_mul of Wild Keccak #2, see keccakf_mul_h32 in wildkeccak.c */
+static WK_TARGET __always_inline void WK_FN(keccakf_mul_h32)(WK_V *s)
+{
+    const WK_V h0 = s[0], h1 = s[1], h2 = s[2], h3 = s[3];
+    const WK_V bc0 = WK_XOR(h0, WK_ROTL(h2, 1));
+    const WK_V bc1 = WK_XOR(h1, WK_ROTL(h3, 1));
+    const WK_V bc2 = WK_XOR(h2, WK_SET1(2));
+    const WK_V bc3 = WK_XOR(h3, WK_ROTL(h0, 1));
+    const WK_V bc4 = WK_XOR(WK_SET1(1), WK_ROTL(h1, 1));
+
+    s[0] = WK_XOR(h0, bc4);
+    s[1] = WK_ROTL(bc0, 44);
+    s[2] = WK_ROTL(bc1, 43);
+    s[3] = WK_ROTL(bc2, 21);
+    s[4] = WK_ROTL(bc3, 14);
+    s[5] = WK_ROTL(WK_XOR(h3, bc2), 28);
+    s[6] = WK_ROTL(bc3, 20);
+    s[7] = WK_ROTL(bc4, 3);
+    s[8] = WK_ROTL(WK_XOR(WK_SET1(0x8000000000000000ULL), bc0), 45);
+    s[9] = WK_ROTL(bc1, 61);
+    s[10] = WK_ROTL(WK_XOR(h1, bc0), 1);
+    s[11] = WK_ROTL(bc1, 6);
+    s[12] = WK_ROTL(bc2, 25);
+    s[13] = WK_ROTL(bc3, 8);
+    s[14] = WK_ROTL(bc4, 18);
+    s[15] = WK_ROTL(WK_XOR(WK_SET1(1), bc3), 27);
+    s[16] = WK_ROTL(bc4, 36);
+    s[17] = WK_ROTL(bc0, 10);
+    s[18] = WK_ROTL(bc1, 15);
+    s[19] = WK_ROTL(bc2, 56);
+    s[20] = WK_ROTL(WK_XOR(h2, bc1), 62);
+    s[21] = WK_ROTL(bc2, 55);
+    s[22] = WK_ROTL(bc3, 39);
+    s[23] = WK_ROTL(bc4, 41);
+    s[24] = WK_ROTL(bc0, 2);
+
+    WK_FN(chi_iota)(s);
+}
+
+/* The 23 rounds that mix the scratchpad in after the first keccakf_mul */
+static WK_TARGET void WK_FN(wildkeccak_rounds)(WK_V *st, const uint64_t *restrict pscr, const struct WK_FN(recip) *rc)
+{
+    uint64_t idx[WK_LANES][KK_MIXIN_SIZE];
+    const int hint = opt_prefetch_hint;
+    unsigned i, x, l;
+
+    for (i = 1; i < KK_MIXIN_SIZE; ++i)
+    {
+        /* force CPU to prefetch cache lines of every lane from RAM in the background */
+        for (x = 0; x < KK_MIXIN_SIZE; x++)
+        {
+            const WK_V line = WK_FN(line_index)(st[x], rc);
+            uint64_t lw[WK_LANES];
+
+            memcpy(lw, &line, sizeof(line));
+
+            for (l = 0; l < WK_LANES; l++)
+            {
+                idx[l][x] = lw[l];
+                prefetch_hint(&pscr[lw[l]], hint);
+            }
+        }
+
+        for (x = 0; x < KK_MIXIN_SIZE >> 2; x++)
+            WK_FN(mix_group)(st, pscr, idx, x);
+
+        WK_FN(keccakf_mul)(st);
+    }
+}
+
+static WK_TARGET __always_inline void WK_FN(wildkeccak)(WK_V *st, const uint64_t *restrict pscr, const struct WK_FN(recip) *rc)
+{
+    WK_FN(keccakf_mul)(st);
+    WK_FN(wildkeccak_rounds)(st, pscr, rc);
+}
+
+/* Wild Keccak #2 over the result of #1 and the output, for the midstate path */
+static WK_TARGET __always_inline void WK_FN(wild_keccak_final)(WK_V *st, uint8_t *const *md, const uint64_t *restrict pscr,
+                                                               const struct WK_FN(recip) *rc)
+{
+    const uint64_t *sw = (const uint64_t *)st;
+    unsigned i, l;
+
+    // st[0]..st[3] already contains resulting hash of #1
+    WK_FN(keccakf_mul_h32)(st);
+    WK_FN(wildkeccak_rounds)(st, pscr, rc);
+
+    for (l = 0; l < WK_LANES; l++)
+        for (i = 0; i < 4; i++)
+            __put_unaligned_cpu64(sw[i * WK_LANES + l], md[l] + i * 8);
+}
+
+WK_TARGET void WK_FN(wild_keccak_hash_dbl)(const uint8_t *const *in, size_t inlen, uint8_t *const *md,
+                                           const struct wk_scratchpad *scr)
+{
+    WK_V st[25];
+    uint64_t *sw = (uint64_t *)st;
+    const uint64_t *pscr = scr->pscr;
+    struct WK_FN(recip) rc;
+    uint8_t temp[144];
+    size_t i, off = 0;
+    const size_t rsiz = HASH_DATA_AREA;
+    const size_t rsizw = HASH_DATA_AREA / 8;
+    unsigned l;
+
+    WK_FN(recip_init)(&rc, scr->lines, scr->recip);
+
+    // Wild Keccak #1
+    for (i = 0; i < 25; i++)
+        st[i] = WK_ZERO();
+    for ( ; inlen >= rsiz; inlen -= rsiz, off += rsiz) {
+        for (l = 0; l < WK_LANES; l++)
+            for (i = 0; i < rsizw; i++)
+                sw[i * WK_LANES + l] ^= __get_unaligned_cpu64(in[l] + off + i * 8);
+        WK_FN(wildkeccak)(st, pscr, &rc);
+    }
+    // last block and padding
+    for (l = 0; l < WK_LANES; l++) {
+        memcpy(temp, in[l] + off, inlen);
+        temp[inlen] = 1;
+        memset(temp + inlen + 1, 0, rsiz - inlen - 1);
+        temp[rsiz - 1] |= 0x80;
+
+        for (i = 0; i < rsizw; i++)
+            sw[i * WK_LANES + l] ^= ((uint64_t *) temp)[i];
+    }
+    WK_FN(wildkeccak)(st, pscr, &rc);
+
+    // Wild Keccak #2 - st[0]..st[3] already contains resulting hash of #1
+    for (i = 5; i < 25; i++)
+        st[i] = WK_ZERO();
+    st[4] = WK_SET1(0x0000000000000001ULL);
+    st[16] = WK_SET1(0x8000000000000000ULL);
+    WK_FN(wildkeccak)(st, pscr, &rc);
+
+    for (l = 0; l < WK_LANES; l++)
+        for (i = 0; i < 4; i++)
+            __put_unaligned_cpu64(sw[i * WK_LANES + l], md[l] + i * 8);
+}
+
+WK_TARGET void WK_FN(wild_keccak_hash_mid)(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md,
+                                           const struct wk_scratchpad *scr)
+{
+    WK_V st[25];
+    struct WK_FN(recip) rc;
+
+    WK_FN(recip_init)(&rc, scr->lines, scr->recip);
+
+    // Wild Keccak #1, the block is already absorbed
+    WK_FN(keccakf_mul_mid)(st, mid, nonce);
+    WK_FN(wildkeccak_rounds)(st, scr->pscr, &rc);
+
+    // Wild Keccak #2
+    WK_FN(wild_keccak_final)(st, md, scr->pscr, &rc);
+}
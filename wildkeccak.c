@@ -14,21 +14,29 @@
 
 #include "miner.h"
 #include "reciprocal_div64.h"
+#include "wildkeccak.h"
 
-enum {
-  HASH_SIZE = 32,
-  HASH_DATA_AREA = 136,
-};
-
-#define KK_MIXIN_SIZE 24
 __attribute__((const)) static inline uint64_t rotl641(uint64_t x) { return((x << 1) | (x >> 63)); }
 __attribute__((const)) static inline uint64_t rotl64_1(uint64_t x, uint64_t y) { return((x << y) | (x >> (64 - y))); }
 __attribute__((const)) static inline uint64_t bitselect(uint64_t a, uint64_t b, uint64_t c) { return(a ^ (c & (b ^ a))); }
 
+/* chi and iota, the steps every keccakf_mul ends with */
+static __always_inline void keccakf_chi_iota(uint64_t *s)
+{
+    uint64_t tmp1, tmp2;
+
+	tmp1 = s[0]; tmp2 = s[1]; s[0] = bitselect(s[0] ^ s[2], s[0], s[1]); s[1] = bitselect(s[1] ^ s[3], s[1], s[2]); s[2] = bitselect(s[2] ^ s[4], s[2], s[3]); s[3] = bitselect(s[3] ^ tmp1, s[3], s[4]); s[4] = bitselect(s[4] ^ tmp2, s[4], tmp1);
+	tmp1 = s[5]; tmp2 = s[6]; s[5] = bitselect(s[5] ^ s[7], s[5], s[6]); s[6] = bitselect(s[6] ^ s[8], s[6], s[7]); s[7] = bitselect(s[7] ^ s[9], s[7], s[8]); s[8] = bitselect(s[8] ^ tmp1, s[8], s[9]); s[9] = bitselect(s[9] ^ tmp2, s[9], tmp1);
+	tmp1 = s[10]; tmp2 = s[11]; s[10] = bitselect(s[10] ^ s[12], s[10], s[11]); s[11] = bitselect(s[11] ^ s[13], s[11], s[12]); s[12] = bitselect(s[12] ^ s[14], s[12], s[13]); s[13] = bitselect(s[13] ^ tmp1, s[13], s[14]); s[14] = bitselect(s[14] ^ tmp2, s[14], tmp1);
+	tmp1 = s[15]; tmp2 = s[16]; s[15] = bitselect(s[15] ^ s[17], s[15], s[16]); s[16] = bitselect(s[16] ^ s[18], s[16], s[17]); s[17] = bitselect(s[17] ^ s[19], s[17], s[18]); s[18] = bitselect(s[18] ^ tmp1, s[18], s[19]); s[19] = bitselect(s[19] ^ tmp2, s[19], tmp1);
+	tmp1 = s[20]; tmp2 = s[21]; s[20] = bitselect(s[20] ^ s[22], s[20], s[21]); s[21] = bitselect(s[21] ^ s[23], s[21], s[22]); s[22] = bitselect(s[22] ^ s[24], s[22], s[23]); s[23] = bitselect(s[23] ^ tmp1, s[23], s[24]); s[24] = bitselect(s[24] ^ tmp2, s[24], tmp1);
+	s[0] ^= 0x0000000000000001ULL;
+}
+
 static __always_inline void keccakf_mul(uint64_t *s)
 {
     uint64_t bc[5], t[5];
-    uint64_t tmp1, tmp2;
+    uint64_t tmp1;
 	int i;
 	
 	for(i = 0; i < 5; i++)
@@ -68,28 +76,84 @@ static __always_inline void keccakf_mul(uint64_t *s)
 	s[7] = rotl64_1(s[10] ^ bc[4], 3);
 	s[10] = rotl64_1(tmp1, 1);
 	
-	tmp1 = s[0]; tmp2 = s[1]; s[0] = bitselect(s[0] ^ s[2], s[0], s[1]); s[1] = bitselect(s[1] ^ s[3], s[1], s[2]); s[2] = bitselect(s[2] ^ s[4], s[2], s[3]); s[3] = bitselect(s[3] ^ tmp1, s[3], s[4]); s[4] = bitselect(s[4] ^ tmp2, s[4], tmp1);
-	tmp1 = s[5]; tmp2 = s[6]; s[5] = bitselect(s[5] ^ s[7], s[5], s[6]); s[6] = bitselect(s[6] ^ s[8], s[6], s[7]); s[7] = bitselect(s[7] ^ s[9], s[7], s[8]); s[8] = bitselect(s[8] ^ tmp1, s[8], s[9]); s[9] = bitselect(s[9] ^ tmp2, s[9], tmp1);
-	tmp1 = s[10]; tmp2 = s[11]; s[10] = bitselect(s[10] ^ s[12], s[10], s[11]); s[11] = bitselect(s[11] ^ s[13], s[11], s[12]); s[12] = bitselect(s[12] ^ s[14], s[12], s[13]); s[13] = bitselect(s[13] ^ tmp1, s[13], s[14]); s[14] = bitselect(s[14] ^ tmp2, s[14], tmp1);
-	tmp1 = s[15]; tmp2 = s[16]; s[15] = bitselect(s[15] ^ s[17], s[15], s[16]); s[16] = bitselect(s[16] ^ s[18], s[16], s[17]); s[17] = bitselect(s[17] ^ s[19], s[17], s[18]); s[18] = bitselect(s[18] ^ tmp1, s[18], s[19]); s[19] = bitselect(s[19] ^ tmp2, s[19], tmp1);
-	tmp1 = s[20]; tmp2 = s[21]; s[20] = bitselect(s[20] ^ s[22], s[20], s[21]); s[21] = bitselect(s[21] ^ s[23], s[21], s[22]); s[22] = bitselect(s[22] ^ s[24], s[22], s[23]); s[23] = bitselect(s[23] ^ tmp1, s[23], s[24]); s[24] = bitselect(s[24] ^ tmp2, s[24], tmp1);
-	s[0] ^= 0x0000000000000001ULL;
+	keccakf_chi_iota(s);
 }
 
-static void wildkeccak(uint64_t *restrict st, const uint64_t *restrict pscr, uint64_t scr_size, struct reciprocal_value64 recip)
+/*
+ * The first keccakf_mul of a single-block blob, finished for one nonce:
+ * only what word 0 reaches is worked out here, the rest is in mid.
+ */
+static __always_inline void keccakf_mul_mid(uint64_t *s, const struct wk_midstate *mid, uint32_t nonce)
 {
-    uint64_t x, i = 0;
-    uint64_t idx[KK_MIXIN_SIZE];
-	
-    goto skipfirst;
-    for (; i < KK_MIXIN_SIZE; ++i)
-    {
-        /* force CPU to prefetch cache line from RAM in the background */
-        for (x = 0; x < KK_MIXIN_SIZE; x++)
-        {
-            idx[x] = reciprocal_remainder64(st[x], scr_size, recip) << 2;
-            prefetch1(&pscr[idx[x]]);
-        }
+    const uint64_t *a = mid->s;
+    const uint64_t s0 = mid->w0 ^ ((uint64_t)nonce << 8);
+    const uint64_t t0 = s0 ^ mid->c0;
+    const uint64_t bc0 = t0 ^ mid->r2;
+    const uint64_t bc3 = mid->t3 ^ rotl641(t0);
+
+    memcpy(s, mid->b, sizeof(mid->b));
+    s[0] = s0 ^ mid->bc4;
+    s[1] = rotl64_1(a[6] ^ bc0, 44);
+    s[6] = rotl64_1(a[9] ^ bc3, 20);
+    s[22] = rotl64_1(a[14] ^ bc3, 39);
+    s[13] = rotl64_1(a[19] ^ bc3, 8);
+    s[15] = rotl64_1(a[4] ^ bc3, 27);
+    s[4] = rotl64_1(a[24] ^ bc3, 14);
+    s[24] = rotl64_1(a[21] ^ bc0, 2);
+    s[8] = rotl64_1(a[16] ^ bc0, 45);
+    s[17] = rotl64_1(a[11] ^ bc0, 10);
+    s[10] = rotl64_1(a[1] ^ bc0, 1);
+
+    keccakf_chi_iota(s);
+}
+
+/*
+ * The first keccakf_mul of Wild Keccak #2.  Its input is always the 32-byte
+ * result of #1 with the padding in fixed places: word 4 is 1, word 16 has
+ * the top bit and everything else is zero, which takes the multiplies out
+ * of theta and most XORs out of rho-pi.  Only s[0]..s[3] are read.
+ */
+static __always_inline void keccakf_mul_h32(uint64_t *s)
+{
+    const uint64_t h0 = s[0], h1 = s[1], h2 = s[2], h3 = s[3];
+    const uint64_t bc0 = h0 ^ rotl641(h2);
+    const uint64_t bc1 = h1 ^ rotl641(h3);
+    const uint64_t bc2 = h2 ^ 2;
+    const uint64_t bc3 = h3 ^ rotl641(h0);
+    const uint64_t bc4 = 1 ^ rotl641(h1);
+
+    s[0] = h0 ^ bc4;
+    s[1] = rotl64_1(bc0, 44);
+    s[2] = rotl64_1(bc1, 43);
+    s[3] = rotl64_1(bc2, 21);
+    s[4] = rotl64_1(bc3, 14);
+    s[5] = rotl64_1(h3 ^ bc2, 28);
+    s[6] = rotl64_1(bc3, 20);
+    s[7] = rotl64_1(bc4, 3);
+    s[8] = rotl64_1(0x8000000000000000ULL ^ bc0, 45);
+    s[9] = rotl64_1(bc1, 61);
+    s[10] = rotl64_1(h1 ^ bc0, 1);
+    s[11] = rotl64_1(bc1, 6);
+    s[12] = rotl64_1(bc2, 25);
+    s[13] = rotl64_1(bc3, 8);
+    s[14] = rotl64_1(bc4, 18);
+    s[15] = rotl64_1(1 ^ bc3, 27);
+    s[16] = rotl64_1(bc4, 36);
+    s[17] = rotl64_1(bc0, 10);
+    s[18] = rotl64_1(bc1, 15);
+    s[19] = rotl64_1(bc2, 56);
+    s[20] = rotl64_1(h2 ^ bc1, 62);
+    s[21] = rotl64_1(bc2, 55);
+    s[22] = rotl64_1(bc3, 39);
+    s[23] = rotl64_1(bc4, 41);
+    s[24] = rotl64_1(bc0, 2);
+
+    keccakf_chi_iota(s);
+}
+
+static __always_inline void wildkeccak_mixin(uint64_t *restrict st, const uint64_t *restrict pscr, const uint64_t *idx)
+{
+    uint64_t x;
 
 #if defined(__AVX2__)
 #warning using AVX2 optimizations
@@ -126,48 +190,544 @@ static void wildkeccak(uint64_t *restrict st, const uint64_t *restrict pscr, uin
             st[x+3] ^= pscr[idx[x + 0] + 3] ^ pscr[idx[x + 1] + 3] ^ pscr[idx[x + 2] + 3] ^ pscr[idx[x + 3] + 3];
         }
 #endif
-skipfirst:
-        keccakf_mul(st);
+}
+
+/* compute the scratchpad lines one lane mixes in next and start fetching them */
+static __always_inline void wildkeccak_gather(const uint64_t *restrict st, uint64_t *restrict idx, const uint64_t *restrict pscr,
+                                              uint64_t scr_size, struct reciprocal_value64 recip, int hint)
+{
+    uint64_t x;
+
+    for (x = 0; x < KK_MIXIN_SIZE; x++)
+    {
+        idx[x] = reciprocal_remainder64(st[x], scr_size, recip) << 2;
+        prefetch_hint(&pscr[idx[x]], hint);
     }
 }
 
-static void __always_inline wild_keccak_hash_dbl(const uint8_t *in, size_t inlen, uint8_t *md, const uint64_t* pscr, uint64_t scr_size)
+#if defined(WK_ASM_BMI2)
+/*
+ * The rounds of the assembly kernel.  wk_round_bmi2 mixes a lane in,
+ * permutes it and right away requests the lines of its next round, which
+ * the rounds of the other lanes then hide; --prefetch-distance does not
+ * apply.  The last round has no next round to fetch for.
+ */
+static __always_inline void wildkeccak_rounds_bmi2(uint64_t (*restrict st)[KK_STATE_STRIDE], unsigned lanes,
+                                                   const uint64_t *restrict pscr, uint64_t scr_size, struct reciprocal_value64 recip)
 {
-    uint64_t st[25] __aligned(32);
-    struct reciprocal_value64 recip;
-    uint8_t temp[144];    
-    size_t i;
+    uint64_t idx[WILD_KECCAK_MAX_LANES][KK_MIXIN_SIZE];
+    const int hint = opt_prefetch_hint;
+    const unsigned sh = recip.sh1 | recip.sh2 << 8;
+    uint64_t i, x;
+    unsigned l;
+
+    for (l = 0; l < lanes; l++) {
+        wk_line_indices_bmi2(idx[l], st[l], KK_MIXIN_SIZE, scr_size, recip.m, sh);
+        for (x = 0; x < KK_MIXIN_SIZE; x++)
+            prefetch_hint(&pscr[idx[l][x]], hint);
+    }
+    for (i = 1; i < KK_MIXIN_SIZE; ++i)
+        for (l = 0; l < lanes; l++)
+            wk_round_bmi2(st[l], pscr, idx[l], i + 1 < KK_MIXIN_SIZE ? scr_size : 0, recip.m, sh | hint << 16);
+}
+#endif
+
+/*
+ * Runs `lanes` independent states through the 23 rounds that mix the
+ * scratchpad in after the first keccakf_mul, all together, so the DRAM
+ * latency of one lane is hidden behind the keccakf_mul of the others.
+ * lanes is a compile-time constant in every caller.
+ *
+ * With opt_prefetch_distance == 0 every lane issues its prefetches at the
+ * start of a round, before any lane mixes its lines in.  A distance d > 0
+ * software-pipelines the gather instead: while lane l is mixed and
+ * permuted, the lines of lane l + d are already requested, wrapping into
+ * the next round of the lanes that have finished this one.
+ */
+static __always_inline void wildkeccak_rounds(uint64_t (*restrict st)[KK_STATE_STRIDE], unsigned lanes,
+                                              const uint64_t *restrict pscr, uint64_t scr_size, struct reciprocal_value64 recip,
+                                              bool bmi2)
+{
+    uint64_t idx[WILD_KECCAK_MAX_LANES][KK_MIXIN_SIZE];
+    const int hint = opt_prefetch_hint;
+    const unsigned dist = helpermin((unsigned)opt_prefetch_distance, lanes - 1);
+    uint64_t i;
+    unsigned l;
+
+#if defined(WK_ASM_BMI2)
+    if (bmi2) {
+        wildkeccak_rounds_bmi2(st, lanes, pscr, scr_size, recip);
+        return;
+    }
+#endif
+    if (!dist) {
+        for (i = 1; i < KK_MIXIN_SIZE; ++i)
+        {
+            for (l = 0; l < lanes; l++)
+                wildkeccak_gather(st[l], idx[l], pscr, scr_size, recip, hint);
+
+            for (l = 0; l < lanes; l++)
+            {
+                wildkeccak_mixin(st[l], pscr, idx[l]);
+                keccakf_mul(st[l]);
+            }
+        }
+        return;
+    }
+
+    for (l = 0; l < dist; l++)
+        wildkeccak_gather(st[l], idx[l], pscr, scr_size, recip, hint);
+
+    for (i = 1; i < KK_MIXIN_SIZE; ++i)
+    {
+        for (l = 0; l < lanes; l++)
+        {
+            const unsigned next = l + dist;
+
+            if (next < lanes)
+                wildkeccak_gather(st[next], idx[next], pscr, scr_size, recip, hint);
+            else if (i + 1 < KK_MIXIN_SIZE) /* lane next - lanes already finished round i */
+                wildkeccak_gather(st[next - lanes], idx[next - lanes], pscr, scr_size, recip, hint);
+
+            wildkeccak_mixin(st[l], pscr, idx[l]);
+            keccakf_mul(st[l]);
+        }
+    }
+}
+
+/* The whole permutation: the first keccakf_mul, then the mixing rounds */
+static __always_inline void wildkeccak_lanes(uint64_t (*restrict st)[KK_STATE_STRIDE], unsigned lanes,
+                                             const uint64_t *restrict pscr, uint64_t scr_size, struct reciprocal_value64 recip)
+{
+    unsigned l;
+
+    for (l = 0; l < lanes; l++)
+        keccakf_mul(st[l]);
+    wildkeccak_rounds(st, lanes, pscr, scr_size, recip, false);
+}
+
+/* Wild Keccak #2 over the result of #1 and the output, for the midstate path */
+static __always_inline void wild_keccak_final_lanes(uint64_t (*restrict st)[KK_STATE_STRIDE], uint8_t *const *md, unsigned lanes,
+                                                    const uint64_t *restrict pscr, uint64_t scr_size, struct reciprocal_value64 recip,
+                                                    bool bmi2)
+{
+    unsigned l;
+
+    // st[0]..st[3] already contains resulting hash of #1
+    for (l = 0; l < lanes; l++)
+        keccakf_mul_h32(st[l]);
+    wildkeccak_rounds(st, lanes, pscr, scr_size, recip, bmi2);
+
+    for (l = 0; l < lanes; l++)
+        memcpy(md[l], st[l], 32);
+}
+
+static __always_inline void wild_keccak_hash_dbl_lanes(const uint8_t *const *in, size_t inlen, uint8_t *const *md, unsigned lanes,
+                                                       const struct wk_scratchpad *scr)
+{
+    uint64_t st[WILD_KECCAK_MAX_LANES][KK_STATE_STRIDE] __aligned(32);
+    const uint64_t *pscr = scr->pscr;
+    const uint64_t scr_size = scr->lines;
+    const struct reciprocal_value64 recip = scr->recip;
+    uint8_t temp[144];
+    size_t i, off = 0;
     const size_t rsiz = HASH_DATA_AREA;
     const size_t rsizw = HASH_DATA_AREA / 8;
-
-    scr_size >>= 2; /* scr_size now in crypto::hash units (32 bytes) */
-    recip = reciprocal_value64(scr_size);
+    unsigned l;
 
     // Wild Keccak #1
     memset(st, 0, sizeof(st));
-    for ( ; inlen >= rsiz; inlen -= rsiz, in += rsiz) {
-        for (i = 0; i < rsizw; i++)
-            st[i] ^= ((uint64_t *) in)[i];
-        wildkeccak(st, pscr, scr_size, recip);
+    for ( ; inlen >= rsiz; inlen -= rsiz, off += rsiz) {
+        for (l = 0; l < lanes; l++)
+            for (i = 0; i < rsizw; i++)
+                st[l][i] ^= ((const uint64_t *) (in[l] + off))[i];
+        wildkeccak_lanes(st, lanes, pscr, scr_size, recip);
     }
     // last block and padding
-    memcpy(temp, in, inlen);
-    temp[inlen++] = 1;
-    memset(temp + inlen, 0, rsiz - inlen);
-    temp[rsiz - 1] |= 0x80;
+    for (l = 0; l < lanes; l++) {
+        memcpy(temp, in[l] + off, inlen);
+        temp[inlen] = 1;
+        memset(temp + inlen + 1, 0, rsiz - inlen - 1);
+        temp[rsiz - 1] |= 0x80;
 
-    for (i = 0; i < rsizw; i++) {
-        st[i] ^= ((uint64_t *) temp)[i];
+        for (i = 0; i < rsizw; i++) {
+            st[l][i] ^= ((uint64_t *) temp)[i];
+        }
     }
-    wildkeccak(st, pscr, scr_size, recip);
+    wildkeccak_lanes(st, lanes, pscr, scr_size, recip);
 
     // Wild Keccak #2 - st[0]..st[3] already contains resulting hash of #1
-    memset(&st[5], 0, 160);
-    st[4] = 0x0000000000000001ULL;
-    st[16] |= 0x8000000000000000ULL;
-    wildkeccak(st, pscr, scr_size, recip);
+    for (l = 0; l < lanes; l++) {
+        memset(&st[l][5], 0, 160);
+        st[l][4] = 0x0000000000000001ULL;
+        st[l][16] |= 0x8000000000000000ULL;
+    }
+    wildkeccak_lanes(st, lanes, pscr, scr_size, recip);
+
+    for (l = 0; l < lanes; l++)
+        memcpy(md[l], st[l], 32);
+}
+
+/* Hashes nonces nonce .. nonce + lanes - 1 of the job mid was built from */
+static __always_inline void wild_keccak_hash_mid_lanes(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md,
+                                                       unsigned lanes, const struct wk_scratchpad *scr, bool bmi2)
+{
+    uint64_t st[WILD_KECCAK_MAX_LANES][KK_STATE_STRIDE] __aligned(32);
+    const uint64_t *pscr = scr->pscr;
+    const uint64_t scr_size = scr->lines;
+    const struct reciprocal_value64 recip = scr->recip;
+    unsigned l;
+
+    // Wild Keccak #1, the block is already absorbed
+    for (l = 0; l < lanes; l++)
+        keccakf_mul_mid(st[l], mid, nonce + l);
+    wildkeccak_rounds(st, lanes, pscr, scr_size, recip, bmi2);
+
+    // Wild Keccak #2
+    wild_keccak_final_lanes(st, md, lanes, pscr, scr_size, recip, bmi2);
+}
+
+static void wild_keccak_hash_dbl_x1(const uint8_t *const *in, size_t inlen, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_dbl_lanes(in, inlen, md, 1, scr);
+}
+
+static void wild_keccak_hash_dbl_x2(const uint8_t *const *in, size_t inlen, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_dbl_lanes(in, inlen, md, 2, scr);
+}
+
+static void wild_keccak_hash_dbl_x4(const uint8_t *const *in, size_t inlen, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_dbl_lanes(in, inlen, md, 4, scr);
+}
+
+static void wild_keccak_hash_dbl_x8(const uint8_t *const *in, size_t inlen, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_dbl_lanes(in, inlen, md, 8, scr);
+}
+
+static void wild_keccak_hash_mid_x1(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 1, scr, false);
+}
+
+static void wild_keccak_hash_mid_x2(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 2, scr, false);
+}
+
+static void wild_keccak_hash_mid_x4(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 4, scr, false);
+}
+
+static void wild_keccak_hash_mid_x8(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 8, scr, false);
+}
+
+#if defined(WK_ASM_BMI2)
+static void wild_keccak_hash_mid_bmi2_x1(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 1, scr, true);
+}
 
-    memcpy(md, st, 32);
+static void wild_keccak_hash_mid_bmi2_x2(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 2, scr, true);
+}
+
+static void wild_keccak_hash_mid_bmi2_x4(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 4, scr, true);
+}
+
+static void wild_keccak_hash_mid_bmi2_x8(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md, const struct wk_scratchpad *scr)
+{
+    wild_keccak_hash_mid_lanes(mid, nonce, md, 8, scr, true);
+}
+#endif
+
+static wild_keccak_hash_dbl_fn wild_keccak_hash_dbl_for_lanes(int lanes)
+{
+    switch (lanes) {
+    case 2:  return wild_keccak_hash_dbl_x2;
+    case 4:  return wild_keccak_hash_dbl_x4;
+    case 8:  return wild_keccak_hash_dbl_x8;
+    default: return wild_keccak_hash_dbl_x1;
+    }
+}
+
+static wild_keccak_hash_mid_fn wild_keccak_hash_mid_for_lanes(int lanes)
+{
+    switch (lanes) {
+    case 2:  return wild_keccak_hash_mid_x2;
+    case 4:  return wild_keccak_hash_mid_x4;
+    case 8:  return wild_keccak_hash_mid_x8;
+    default: return wild_keccak_hash_mid_x1;
+    }
+}
+
+#if defined(WK_ASM_BMI2)
+static wild_keccak_hash_mid_fn wild_keccak_hash_mid_bmi2_for_lanes(int lanes)
+{
+    switch (lanes) {
+    case 2:  return wild_keccak_hash_mid_bmi2_x2;
+    case 4:  return wild_keccak_hash_mid_bmi2_x4;
+    case 8:  return wild_keccak_hash_mid_bmi2_x8;
+    default: return wild_keccak_hash_mid_bmi2_x1;
+    }
+}
+#endif
+
+static void wild_keccak_hash_dbl(const uint8_t *in, size_t inlen, uint8_t *md, const uint64_t* pscr, uint64_t scr_size)
+{
+    struct wk_scratchpad scr = { 0 };
+
+    wk_scratchpad_update(&scr, pscr, scr_size);
+    wild_keccak_hash_dbl_x1(&in, inlen, &md, &scr);
+}
+
+/* Absorbs a job blob into mid, as far as it goes without the nonce.  Only
+ * blobs that fit one block have a midstate; false for anything longer. */
+bool wild_keccak_midstate_init(struct wk_midstate *mid, const uint8_t *blob, size_t len)
+{
+    uint8_t temp[HASH_DATA_AREA];
+    uint64_t *a = mid->s, *b = mid->b;
+    uint64_t t[5], bc[5];
+    size_t i;
+
+    if (len < 5 || len >= HASH_DATA_AREA)
+        return false;
+    memcpy(temp, blob, len);
+    memset(temp + 1, 0, 4);
+    temp[len] = 1;
+    memset(temp + len + 1, 0, HASH_DATA_AREA - len - 1);
+    temp[HASH_DATA_AREA - 1] |= 0x80;
+
+    memset(a, 0, sizeof(mid->s));
+    for (i = 0; i < HASH_DATA_AREA / 8; i++)
+        a[i] = __get_unaligned_cpu64(temp + i * 8);
+
+    for (i = 0; i < 5; i++)
+        t[i] = a[i + 0] ^ a[i + 5] ^ a[i + 10] * a[i + 15] * a[i + 20];
+    bc[1] = t[1] ^ rotl641(t[3]);
+    bc[2] = t[2] ^ rotl641(t[4]);
+    bc[4] = t[4] ^ rotl641(t[1]);
+
+    mid->w0 = a[0];
+    mid->c0 = t[0] ^ a[0];
+    mid->r2 = rotl641(t[2]);
+    mid->t3 = t[3];
+    mid->bc4 = bc[4];
+
+    /* the rho-pi outputs keccakf_mul_mid leaves alone */
+    memset(b, 0, sizeof(mid->b));
+    b[9] = rotl64_1(a[22] ^ bc[1], 61);
+    b[14] = rotl64_1(a[20] ^ bc[4], 18);
+    b[20] = rotl64_1(a[2] ^ bc[1], 62);
+    b[2] = rotl64_1(a[12] ^ bc[1], 43);
+    b[12] = rotl64_1(a[13] ^ bc[2], 25);
+    b[19] = rotl64_1(a[23] ^ bc[2], 56);
+    b[23] = rotl64_1(a[15] ^ bc[4], 41);
+    b[21] = rotl64_1(a[8] ^ bc[2], 55);
+    b[16] = rotl64_1(a[5] ^ bc[4], 36);
+    b[5] = rotl64_1(a[3] ^ bc[2], 28);
+    b[3] = rotl64_1(a[18] ^ bc[2], 21);
+    b[18] = rotl64_1(a[17] ^ bc[1], 15);
+    b[11] = rotl64_1(a[7] ^ bc[1], 6);
+    b[7] = rotl64_1(a[10] ^ bc[4], 3);
+    return true;
+}
+
+static void wild_keccak_line_indices_scalar(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines)
+{
+    const struct reciprocal_value64 R = reciprocal_value64(lines);
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        idx[i] = reciprocal_remainder64(w[i], lines, R) << 2;
+}
+
+#if defined(WK_ASM_BMI2)
+static void wild_keccak_line_indices_bmi2(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines)
+{
+    const struct reciprocal_value64 R = reciprocal_value64(lines);
+
+    wk_line_indices_bmi2(idx, w, n, lines, R.m, R.sh1 | R.sh2 << 8);
+}
+#endif
+
+bool wild_keccak_lanes_valid(int lanes)
+{
+    return lanes == 1 || lanes == 2 || lanes == 4 || lanes == 8;
+}
+
+struct wild_keccak_kernel {
+    const char *name;
+    int lanes;                  /* fixed lane width, 0 = honours --lanes */
+    bool (*supported)(void);
+    wild_keccak_hash_dbl_fn hash;
+    wild_keccak_hash_mid_fn hash_mid;
+    wild_keccak_hash_mid_fn (*hash_mid_for_lanes)(int lanes); /* kernels that honour --lanes */
+    wild_keccak_line_indices_fn line_indices;
+};
+
+#if defined(__x86_64__) && defined(USE_AVX512)
+static bool cpu_has_avx512(void)
+{
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+}
+#endif
+
+#if defined(__x86_64__) && defined(USE_AVX2)
+static bool cpu_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(WK_ASM_BMI2)
+static bool cpu_has_bmi2(void)
+{
+    return __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+}
+#endif
+
+/* in order of preference for "auto" */
+static const struct wild_keccak_kernel kernels[] = {
+#if defined(__x86_64__) && defined(USE_AVX512)
+    { "avx512", 8, cpu_has_avx512, wild_keccak_hash_dbl_avx512, wild_keccak_hash_mid_avx512, NULL,
+      wild_keccak_line_indices_avx512 },
+#endif
+#if defined(__x86_64__) && defined(USE_AVX2)
+    { "avx2", 4, cpu_has_avx2, wild_keccak_hash_dbl_avx2, wild_keccak_hash_mid_avx2, NULL,
+      wild_keccak_line_indices_avx2 },
+#endif
+#if defined(WK_ASM_BMI2)
+    { "bmi2", 0, cpu_has_bmi2, NULL, NULL, wild_keccak_hash_mid_bmi2_for_lanes,
+      wild_keccak_line_indices_bmi2 },
+#endif
+    { "scalar", 0, NULL, NULL, NULL, wild_keccak_hash_mid_for_lanes, wild_keccak_line_indices_scalar },
+};
+
+static const struct wild_keccak_kernel *kernel = &kernels[ARRAY_SIZE(kernels) - 1];
+
+/*
+ * Checks the midstate path of k against the generic absorb-per-nonce one,
+ * for the blob lengths pools send, over a small scratchpad of its own.
+ */
+static bool wild_keccak_kernel_verify(const struct wild_keccak_kernel *k, int lanes)
+{
+    static const size_t lens[] = { 40, 76, 81, 128 };
+    const wild_keccak_hash_dbl_fn hash_fn = k->hash ? k->hash : wild_keccak_hash_dbl_for_lanes(lanes);
+    const wild_keccak_hash_mid_fn mid_fn = k->hash_mid ? k->hash_mid : k->hash_mid_for_lanes(lanes);
+    static uint64_t pscr[4096] __aligned(32);
+    struct wk_scratchpad scr = { 0 };
+    struct wk_midstate mid;
+    uint8_t blob[WILD_KECCAK_MAX_LANES][128], hash[WILD_KECCAK_MAX_LANES][HASH_SIZE], ref[WILD_KECCAK_MAX_LANES][HASH_SIZE];
+    const uint8_t *in[WILD_KECCAK_MAX_LANES];
+    uint8_t *md[WILD_KECCAK_MAX_LANES], *mdref[WILD_KECCAK_MAX_LANES];
+    const uint32_t nonce = 0xfffffffeU; /* wraps within the lanes */
+    size_t i;
+    int l;
+
+    for (i = 0; i < ARRAY_SIZE(pscr); i++)
+        pscr[i] = i * 0x9e3779b97f4a7c15ULL ^ (i << 40);
+    wk_scratchpad_update(&scr, pscr, ARRAY_SIZE(pscr) - 12);
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        for (l = 0; l < lanes; l++) {
+            memset(blob[l], 0x5a ^ (int)i, sizeof(blob[l]));
+            __put_unaligned_cpu32(nonce + l, blob[l] + 1);
+            in[l] = blob[l];
+            md[l] = hash[l];
+            mdref[l] = ref[l];
+        }
+        hash_fn(in, lens[i], mdref, &scr);
+        if (!wild_keccak_midstate_init(&mid, blob[0], lens[i]))
+            return false;
+        mid_fn(&mid, nonce, md, &scr);
+        if (memcmp(hash, ref, lanes * HASH_SIZE))
+            return false;
+    }
+    return true;
+}
+
+/* Picks the kernel used by scanhash_wildkeccak and settles opt_lanes for it.
+ * name may be NULL or "auto" to take the best kernel this CPU runs. */
+bool wild_keccak_set_kernel(const char *name)
+{
+    const struct wild_keccak_kernel *k = NULL;
+    size_t i;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    for (i = 0; i < ARRAY_SIZE(kernels); i++) {
+        if (name && strcmp(name, "auto") && strcmp(name, kernels[i].name))
+            continue;
+        if (kernels[i].supported && !kernels[i].supported()) {
+            if (name && strcmp(name, "auto")) {
+                applog(LOG_ERR, "WildKeccak kernel '%s' is not supported by this CPU", name);
+                return false;
+            }
+            continue;
+        }
+        k = &kernels[i];
+        break;
+    }
+    if (!k) {
+        applog(LOG_ERR, "Unknown WildKeccak kernel '%s'", name);
+        return false;
+    }
+
+    if (k->lanes) {
+        if (opt_lanes && opt_lanes != k->lanes)
+            applog(LOG_WARNING, "WildKeccak kernel %s always hashes %d lanes, ignoring --lanes=%d",
+                   k->name, k->lanes, opt_lanes);
+        opt_lanes = k->lanes;
+    } else if (!opt_lanes) {
+        opt_lanes = WILD_KECCAK_DEFAULT_LANES;
+    }
+    if (!wild_keccak_kernel_verify(k, opt_lanes)) {
+        applog(LOG_ERR, "WildKeccak kernel %s gives wrong hashes from the job midstate", k->name);
+        return false;
+    }
+    kernel = k;
+    return true;
+}
+
+const char *wild_keccak_kernel_name(void)
+{
+    return kernel->name;
+}
+
+/* Describes the idx-th kernel built into this binary, in "auto" preference
+ * order.  lanes is 0 for kernels that honour --lanes.  Returns false once
+ * idx runs past the last kernel. */
+bool wild_keccak_kernel_info(unsigned idx, const char **name, int *lanes, bool *supported)
+{
+    if (idx >= ARRAY_SIZE(kernels))
+        return false;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+#endif
+    *name = kernels[idx].name;
+    *lanes = kernels[idx].lanes;
+    *supported = !kernels[idx].supported || kernels[idx].supported();
+    return true;
+}
+
+/* Runs the line number reduction of the idx-th kernel over n words, for
+ * the benchmark; same indexing and return as wild_keccak_kernel_info. */
+bool wild_keccak_line_indices(unsigned idx, uint64_t *out, const uint64_t *w, size_t n, uint64_t lines)
+{
+    if (idx >= ARRAY_SIZE(kernels))
+        return false;
+    kernels[idx].line_indices(out, w, n, lines);
+    return true;
 }
 
 void wild_keccak_hash_dbl_use_global_scratch(const uint8_t *in, size_t inlen, uint8_t *md)
@@ -175,24 +735,56 @@ void wild_keccak_hash_dbl_use_global_scratch(const uint8_t *in, size_t inlen, ui
     wild_keccak_hash_dbl(in, inlen, md, (uint64_t*)pscratchpad_buff, (uint64_t)scratchpad_size);
 }
 
-int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done)
+/* The generic per-nonce absorb is left to wild_keccak_hash_dbl, which the
+ * share checks use; here every hash starts from the job's midstate. */
+int scanhash_wildkeccak(int thr_id, uint32_t *pdata, const struct wk_midstate *mid, const uint32_t *ptarget,
+                        uint32_t max_nonce, unsigned long *hashes_done, struct result_ring *ring)
 {
     uint32_t *nonceptr = (uint32_t*) (((char*)pdata) + 1);
-    uint32_t n = *nonceptr - 1;
-    const uint32_t first_nonce = n + 1;
+    const uint64_t nonce_hi = (uint64_t)*(uint32_t*) (((char*)pdata) + 5) << 32;
+    uint32_t n = *nonceptr;
+    const uint32_t first_nonce = n;
     const uint32_t Htarg = ptarget[7];
-    uint32_t hash[HASH_SIZE / 4] __attribute__((aligned(32)));
+    const unsigned lanes = opt_lanes;
+    const wild_keccak_hash_mid_fn mid_fn = kernel->hash_mid ? kernel->hash_mid : kernel->hash_mid_for_lanes(lanes);
+    const uint64_t *pscr = pscratchpad_thr ? pscratchpad_thr[thr_id] : pscratchpad_buff;
+    struct wk_scratchpad scr = { 0 };
+    uint32_t hash[WILD_KECCAK_MAX_LANES][HASH_SIZE / 4] __attribute__((aligned(32)));
+    uint8_t *md[WILD_KECCAK_MAX_LANES];
+    unsigned l;
+    int found = 0;
+
+    for (l = 0; l < lanes; l++)
+        md[l] = (uint8_t*)hash[l];
 
     do {
-        *nonceptr = ++n;
-        wild_keccak_hash_dbl_use_global_scratch((uint8_t*)pdata, 81, (uint8_t*)hash);
-        //if (unlikely(  *((uint64_t*)&hash[6])    <   *((uint64_t*)&ptarget[6]) ))
-        if (unlikely(hash[7] < ptarget[7])) {
-            *hashes_done = n - first_nonce + 1;
-            return true;
+        /* addenda grow the scratchpad under us; the reciprocal follows its size */
+        const uint64_t lines = scratchpad_size;
+        if (unlikely(!lines))
+            break; /* reset for a full download, miner_thread waits for it */
+        wk_scratchpad_update(&scr, pscr, lines);
+        mid_fn(mid, n, md, &scr);
+        for (l = 0; l < lanes; l++) {
+            //if (unlikely(  *((uint64_t*)&hash[l][6])    <   *((uint64_t*)&ptarget[6]) ))
+            if (unlikely(hash[l][7] < Htarg)) {
+                if (!ring) {
+                    *nonceptr = n + l;
+                    *hashes_done = n + l - first_nonce + 1;
+                    return true;
+                }
+                if (unlikely(!result_ring_push(ring, nonce_hi | (n + l), hash[l]))) {
+                    /* hashed again by the next scan, which starts at n + l */
+                    *nonceptr = n + l - 1;
+                    *hashes_done = n + l - first_nonce;
+                    return found;
+                }
+                found++;
+            }
         }
+        n += lanes;
     } while (likely((n <= max_nonce && !work_restart[thr_id].restart)));
 
-    *hashes_done = n - first_nonce + 1;
-    return 0;
+    *nonceptr = n - 1;
+    *hashes_done = n - first_nonce;
+    return found;
 }
@@ -0,0 +1,69 @@
+#ifndef WILDKECCAK_H
+#define WILDKECCAK_H
+
+/* Internal interface between wildkeccak.c and its per-ISA kernels. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "reciprocal_div64.h"
+
+enum {
+  HASH_SIZE = 32,
+  HASH_DATA_AREA = 136,
+};
+
+#define KK_MIXIN_SIZE 24
+#define KK_STATE_STRIDE 28 /* 25 state words padded so every lane stays 32-byte aligned */
+
+/* The scratchpad a hash reads, its size in 32-byte lines and the
+ * reciprocal of that size used to reduce state words to line numbers. */
+struct wk_scratchpad {
+    const uint64_t *pscr;
+    uint64_t lines;
+    struct reciprocal_value64 recip;
+};
+
+/* Points scr at pscr, redoing the 128-bit division only if the size changed */
+static inline void wk_scratchpad_update(struct wk_scratchpad *scr, const uint64_t *pscr, uint64_t scr_size)
+{
+    scr->pscr = pscr;
+    if (scr->lines != scr_size >> 2) {
+        scr->lines = scr_size >> 2;
+        scr->recip = reciprocal_value64(scr->lines);
+    }
+}
+
+/* Hashes one input per lane; every lane shares inlen. */
+typedef void (*wild_keccak_hash_dbl_fn)(const uint8_t *const *in, size_t inlen, uint8_t *const *md,
+                                        const struct wk_scratchpad *scr);
+
+/* Hashes nonce + l in lane l, for the job blob mid was built from */
+typedef void (*wild_keccak_hash_mid_fn)(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md,
+                                        const struct wk_scratchpad *scr);
+
+/* Sets idx[i] to the first word of the scratchpad line w[i] selects */
+typedef void (*wild_keccak_line_indices_fn)(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines);
+
+#if defined(__x86_64__) && defined(USE_BMI2) && !defined(_WIN64)
+#define WK_ASM_BMI2 1
+/* wildkeccak-x86_64.S */
+void wk_round_bmi2(uint64_t *s, const uint64_t *pscr, uint64_t *idx, uint64_t lines, uint64_t m, unsigned sh_hint);
+void wk_line_indices_bmi2(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines, uint64_t m, unsigned sh);
+#endif
+#if defined(__x86_64__) && defined(USE_AVX2)
+void wild_keccak_hash_dbl_avx2(const uint8_t *const *in, size_t inlen, uint8_t *const *md,
+                               const struct wk_scratchpad *scr);
+void wild_keccak_hash_mid_avx2(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md,
+                               const struct wk_scratchpad *scr);
+void wild_keccak_line_indices_avx2(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines);
+#endif
+#if defined(__x86_64__) && defined(USE_AVX512)
+void wild_keccak_hash_dbl_avx512(const uint8_t *const *in, size_t inlen, uint8_t *const *md,
+                                 const struct wk_scratchpad *scr);
+void wild_keccak_hash_mid_avx512(const struct wk_midstate *mid, uint32_t nonce, uint8_t *const *md,
+                                 const struct wk_scratchpad *scr);
+void wild_keccak_line_indices_avx512(uint64_t *idx, const uint64_t *w, size_t n, uint64_t lines);
+#endif
+
+#endif /* WILDKECCAK_H */